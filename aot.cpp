@@ -0,0 +1,440 @@
+/**
+ * Engine for programs translated ahead of time by aot.py (see aot.h). Arrays
+ * are kept like try.cpp keeps them, with the free list in the size field of
+ * inactive entries, so identifiers come out the same as every other engine.
+ *
+ * Anything without a live translation runs in the interpreter below, which is
+ * also what records profiles for aot.py with --aot-profile DIR: every image
+ * that's loaded (the program file and every prg of a non-zero array) is saved
+ * as DIR/HASH.um, and the words executed out of it and the addresses jumped to
+ * are appended to DIR/HASH.txt. Words that were stored to before they were
+ * executed aren't part of the image and aren't recorded.
+**/
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <sys/stat.h>
+
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+#include "aot.h"
+
+#define REG(x) s.registers[x]
+#define REG_I() REG((cur >> 25) & 7)
+#define RA() REG(RX(2, cur))
+#define RB() REG(RX(1, cur))
+#define RC() REG(RX(0, cur))
+#define IMM() (cur & 0x01ffffff) // Immediate value, 25 bits
+
+const char *aot_profile = nullptr;
+
+namespace {
+
+/**
+ * What the interpreter saw of the current image while profiling, one byte per
+ * word so it can be indexed without shifting.
+**/
+struct Profile {
+    uint64_t hash;
+    reg_t size;
+    uint8_t *executed;
+    uint8_t *jumped;
+    uint8_t *dirty; // Stored to since the image was loaded
+};
+
+Profile profile;
+
+void set_next(AotState &s, reg_t ident, reg_t dst) {
+    s.arrays[ident].size = dst - ident - 1;
+}
+
+reg_t get_next(AotState &s, reg_t ident) {
+    return s.arrays[ident].size + ident + 1;
+}
+
+/**
+ * Save the image about to run so aot.py can translate it, and start profiling
+ * it. Nothing is recorded if the directory can't be written.
+**/
+void profile_begin(const reg_t *data, reg_t size) {
+    profile.hash = aot_hash(data, size);
+    profile.size = size;
+    profile.executed = (uint8_t *)std::calloc(size + 1, 1);
+    profile.jumped = (uint8_t *)std::calloc(size + 1, 1);
+    profile.dirty = (uint8_t *)std::calloc(size + 1, 1);
+
+    char path[4096];
+    std::snprintf(
+        path, sizeof(path), "%s/%016" PRIx64 ".um", aot_profile, profile.hash
+    );
+    struct stat st;
+    if(stat(path, &st) == 0) return;
+
+    FILE *fp = std::fopen(path, "wb");
+    if(!fp) {
+        perror("Failed to save image for aot.py");
+        return;
+    }
+    for(reg_t i = 0; i < size; ++i) {
+        uint8_t buf[4] = {
+            (uint8_t)(data[i] >> 24), (uint8_t)(data[i] >> 16),
+            (uint8_t)(data[i] >> 8), (uint8_t)data[i]
+        };
+        std::fwrite(buf, 1, 4, fp);
+    }
+    std::fclose(fp);
+}
+
+/**
+ * Append what was executed as "run START END" lines for each stretch of
+ * executed words and "jump PC" for each address a prg landed on.
+**/
+void profile_end() {
+    if(!profile.executed) return;
+
+    char path[4096];
+    std::snprintf(
+        path, sizeof(path), "%s/%016" PRIx64 ".txt", aot_profile, profile.hash
+    );
+    FILE *fp = std::fopen(path, "a");
+    if(!fp) {
+        perror("Failed to save profile for aot.py");
+    }
+    else {
+        for(reg_t i = 0; i < profile.size;) {
+            if(!profile.executed[i]) {
+                ++i;
+                continue;
+            }
+            reg_t start = i;
+            while(i < profile.size && profile.executed[i]) ++i;
+            std::fprintf(fp, "run %u %u\n", start, i);
+        }
+        for(reg_t i = 0; i < profile.size; ++i) {
+            if(profile.jumped[i]) std::fprintf(fp, "jump %u\n", i);
+        }
+        std::fclose(fp);
+    }
+
+    std::free(profile.executed);
+    std::free(profile.jumped);
+    std::free(profile.dirty);
+    profile.executed = profile.jumped = profile.dirty = nullptr;
+}
+
+void profile_jump(reg_t pc) {
+    if(pc < profile.size) profile.jumped[pc] = 1;
+}
+
+/**
+ * Translation of exactly this image, or nullptr. Only images of the same size
+ * are hashed, so a program with no translation never pays for it.
+**/
+const AotImage *find_image(const reg_t *data, reg_t size) {
+    bool any = false;
+    for(size_t i = 0; i < aot_table.nimages; ++i) {
+        any |= aot_table.images[i]->size == size;
+    }
+    if(!any) return nullptr;
+
+    uint64_t hash = aot_hash(data, size);
+    for(size_t i = 0; i < aot_table.nimages; ++i) {
+        const AotImage *image = aot_table.images[i];
+        if(image->size == size && image->hash == hash) return image;
+    }
+    return nullptr;
+}
+
+void uninstall(AotState &s) {
+    std::free(s.label);
+    std::free(s.owner);
+    s.owned = 0;
+    s.label = nullptr;
+    s.owner = nullptr;
+    s.image = nullptr;
+}
+
+/**
+ * Point the per-word tables at the translation of the image now in array 0.
+ * They only go as far as the last translated word.
+**/
+void install(AotState &s, const AotImage *image) {
+    uninstall(s);
+    if(!image || image->nruns == 0) return;
+
+    s.image = image;
+    s.owned = image->runs[image->nruns - 1].end;
+    s.label = (uint32_t *)std::calloc(s.owned, sizeof(uint32_t));
+    s.owner = (uint32_t *)std::calloc(s.owned, sizeof(uint32_t));
+
+    for(size_t i = 0; i < image->nentries; ++i) {
+        s.label[image->entries[i].pc] = i + 1;
+    }
+    for(size_t i = 0; i < image->nruns; ++i) {
+        for(reg_t pc = image->runs[i].start; pc < image->runs[i].end; ++pc) {
+            s.owner[pc] = i + 1;
+        }
+    }
+}
+
+/**
+ * Translated code with a label at pc which hasn't been written over, if any.
+**/
+AotBlock live_block(const AotState &s, reg_t pc) {
+    if(pc >= s.owned || !s.label[pc]) return nullptr;
+    return s.image->entries[s.label[pc] - 1].block;
+}
+
+/**
+ * The new image gets its translation if there is one, or a profile.
+**/
+void begin_image(AotState &s) {
+    const AotArray &prog = s.arrays[0];
+    if(aot_profile) {
+        profile_end();
+        profile_begin(prog.data, prog.size);
+    }
+    else {
+        install(s, find_image(prog.data, prog.size));
+    }
+}
+
+/**
+ * prg of a non-zero array, failing like try.cpp does.
+**/
+Error load(AotState &s, reg_t ident) {
+    if(ident >= s.narrays) return ERR_ARR;
+
+    const AotArray &origin = s.arrays[ident];
+    if(origin.data == nullptr) return ERR_PRG;
+
+    AotArray &prog = s.arrays[0];
+    prog.size = origin.size;
+    prog.data = (reg_t *)std::realloc(prog.data, prog.size * sizeof(reg_t));
+    std::memcpy(prog.data, origin.data, prog.size * sizeof(reg_t));
+    begin_image(s);
+    return ERR_OK;
+}
+
+/**
+ * Switch based interpreter for everything that isn't translated. It returns
+ * EXIT_JUMP at the first prg 0 that lands on live translated code and
+ * EXIT_LOAD for a prg of any other array, which goes through aot_run so both
+ * paths load images the same way.
+**/
+template<bool PROFILE>
+AotExit interpret(AotState &s) {
+    reg_t pc = s.pc;
+    uint64_t steps = s.steps;
+
+    while(pc < s.arrays[0].size) {
+        reg_t cur = s.arrays[0].data[pc++];
+        ++steps;
+        if constexpr(PROFILE) {
+            if(!profile.dirty[pc - 1]) profile.executed[pc - 1] = 1;
+        }
+
+        switch(OPCODE(cur)) {
+            case OP_MOV:
+                RA() = RC()? RB() : RA();
+                break;
+
+            case OP_LDA:
+                if(!aot_lda(s, RA(), RB(), RC())) goto fail_arr;
+                break;
+
+            case OP_STA: {
+                reg_t a = RA(), b = RB();
+                if constexpr(PROFILE) {
+                    if(a == 0 && b < profile.size) profile.dirty[b] = 1;
+                }
+                if(aot_sta(s, a, b, RC()) == 1) goto fail_arr;
+                break;
+            }
+
+            case OP_ADD:
+                RA() = RB() + RC();
+                break;
+
+            case OP_MUL:
+                RA() = RB() * RC();
+                break;
+
+            case OP_DIV: {
+                reg_t c = RC();
+                if(c == 0) {
+                    s.error = ERR_DIV;
+                    goto stop;
+                }
+                RA() = RB() / c;
+                break;
+            }
+
+            case OP_NAN:
+                RA() = ~(RB() & RC());
+                break;
+
+            case OP_HLT:
+                s.error = ERR_OK;
+                goto stop;
+
+            case OP_NEW:
+                RB() = aot_new(s, RC());
+                break;
+
+            case OP_DEL:
+                if(RC() == 0) {
+                    s.error = ERR_DEL;
+                    goto stop;
+                }
+                aot_del(s, RC());
+                break;
+
+            case OP_OUT:
+                if(RC() > 0xff) {
+                    s.error = ERR_CHR;
+                    goto stop;
+                }
+                output_putc(RC());
+                break;
+
+            case OP_INP:
+                RC() = input_getc(steps);
+                break;
+
+            case OP_PRG: {
+                PERF_CHECK(steps);
+                s.steps = steps;
+                CHECK_POINT(steps, pc, cur, s.registers, aot_check_arrays, &s);
+                if(RB()) {
+                    s.pc = pc;
+                    s.ident = RB();
+                    s.target = RC();
+                    return EXIT_LOAD;
+                }
+                pc = RC();
+                if constexpr(PROFILE) {
+                    profile_jump(pc);
+                }
+                else if(live_block(s, pc)) {
+                    s.pc = pc;
+                    return EXIT_JUMP;
+                }
+                break;
+            }
+
+            case OP_LDI:
+                REG_I() = IMM();
+                break;
+
+            default:
+                s.error = ERR_INV;
+                goto stop;
+        }
+    }
+    s.error = ERR_EOF;
+    goto stop;
+
+fail_arr:
+    s.error = ERR_ARR;
+stop:
+    s.pc = pc;
+    s.steps = steps;
+    return EXIT_STOP;
+}
+
+}
+
+reg_t aot_new(AotState &s, reg_t size) {
+    reg_t ident = s.free;
+    if(ident) {
+        s.free = get_next(s, ident);
+    }
+    else {
+        ident = s.narrays;
+        s.free = ident + 1;
+        s.narrays *= 2;
+        s.arrays = (AotArray *)std::realloc(
+            s.arrays, s.narrays * sizeof(AotArray)
+        );
+        std::memset(&s.arrays[ident], 0, ident * sizeof(AotArray));
+        set_next(s, s.narrays - 1, 0);
+    }
+    s.arrays[ident].size = size;
+    s.arrays[ident].data = size? (reg_t *)std::calloc(size, sizeof(reg_t)) : nullptr;
+    return ident;
+}
+
+void aot_del(AotState &s, reg_t ident) {
+    std::free(s.arrays[ident].data);
+    s.arrays[ident].data = nullptr;
+    set_next(s, ident, s.free);
+    s.free = ident;
+}
+
+/**
+ * Take a run's labels out of the table and stop watching its words, they're
+ * interpreted from now on.
+**/
+void aot_stale(AotState &s, uint32_t run) {
+    const AotRange &range = s.image->runs[run - 1];
+    for(reg_t pc = range.start; pc < range.end; ++pc) {
+        s.label[pc] = 0;
+        s.owner[pc] = 0;
+    }
+}
+
+void aot_check_arrays(void *ctx) {
+    AotState &s = *(AotState *)ctx;
+    for(reg_t i = 0; i < s.narrays; ++i) {
+        if(s.arrays[i].data) check_array(i, s.arrays[i].data, s.arrays[i].size);
+    }
+}
+
+Error aot_run(const reg_t *code, reg_t size, uint64_t *steps) {
+    AotState s = {};
+    s.narrays = 256;
+    s.arrays = (AotArray *)std::calloc(s.narrays, sizeof(AotArray));
+    s.arrays[0].size = size;
+    s.arrays[0].data = (reg_t *)std::malloc(size * sizeof(reg_t) + 1);
+    if(size) std::memcpy(s.arrays[0].data, code, size * sizeof(reg_t));
+    s.free = 1;
+    set_next(s, s.narrays - 1, 0);
+
+    if(aot_profile) mkdir(aot_profile, 0777);
+    begin_image(s);
+    if(aot_profile) profile_jump(0);
+
+    perf_phase(PERF_EXEC);
+    for(;;) {
+        AotExit exit;
+        if(aot_profile) exit = interpret<true>(s);
+        else if(AotBlock block = live_block(s, s.pc)) exit = block(s);
+        else exit = interpret<false>(s);
+
+        if(exit == EXIT_STOP) break;
+        if(exit == EXIT_LOAD) {
+            if((s.error = load(s, s.ident)) != ERR_OK) break;
+            s.pc = s.target;
+            if(aot_profile) profile_jump(s.pc);
+        }
+    }
+    perf_phase(PERF_TEARDOWN);
+
+    if(aot_profile) profile_end();
+    CHECK_DONE(s.steps, s.error, s.pc, s.registers, aot_check_arrays, &s);
+    *steps = s.steps;
+
+    Error err = s.error;
+    uninstall(s);
+    for(reg_t i = 0; i < s.narrays; ++i) {
+        std::free(s.arrays[i].data);
+    }
+    std::free(s.arrays);
+    return err;
+}
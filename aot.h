@@ -0,0 +1,235 @@
+/**
+ * Runtime for programs translated ahead of time by aot.py, shared by the aot
+ * engine (aot.cpp) and the C++ aot.py generates.
+ *
+ * A translation is of one program image, identified by its size and hash, and
+ * only covers the code a profiling run executed. That's split into runs of
+ * straight-line code ending at a prg, hlt or invalid instruction, with a label
+ * at the start of each and at every address that was jumped to. Consecutive
+ * runs are grouped into functions, and registers are locals in there so they
+ * stay in machine registers. A prg 0 goes through the label table: a target in
+ * the same function is a computed goto, anything else goes back to aot_run,
+ * which calls the function the target is in or hands it to the interpreter in
+ * aot.cpp. That returns to translated code at the next prg 0 that lands on a
+ * label.
+ *
+ * A store to array 0 that changes a translated word marks the run it's in as
+ * stale, which takes its labels out of the table so it's interpreted from then
+ * on, and leaves translated code, which could be running it. A prg of anything
+ * but 0 replaces the image, the new one runs translated only if there's a
+ * translation of exactly that image.
+**/
+#ifndef AOT_H
+#define AOT_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+
+struct AotArray {
+    reg_t size;
+    reg_t *data; // nullptr if inactive or empty
+};
+
+// Why translated code returned to aot_run
+enum AotExit {
+    EXIT_JUMP, // Continue at pc
+    EXIT_LOAD, // prg from array `ident` to `target`
+    EXIT_STOP // Halted or failed with error
+};
+
+struct AotState;
+struct AotImage;
+typedef AotExit (*AotBlock)(AotState &s);
+
+struct AotRange {
+    reg_t start, end; // [start, end)
+};
+
+struct AotState {
+    reg_t registers[8];
+    reg_t pc; // Next instruction, one past the failing one after an error
+    uint64_t steps;
+    Error error;
+    reg_t ident, target; // Operands of a pending EXIT_LOAD
+
+    AotArray *arrays;
+    reg_t narrays;
+    reg_t free; // Head of the free list, same scheme as try.cpp
+
+    // Per word of array 0 while it's a translated image, 0 if not translated
+    reg_t owned; // Words covered, 0 without a translation
+    uint32_t *label; // 1 + index of the entry at that pc
+    uint32_t *owner; // 1 + index of the run the word is in
+    const AotImage *image;
+};
+
+struct AotEntry {
+    reg_t pc;
+    AotBlock block; // Function with the label
+};
+
+struct AotImage {
+    reg_t size;
+    uint64_t hash; // aot_hash of the whole image
+    const AotEntry *entries; // By pc
+    size_t nentries;
+    const AotRange *runs; // By start
+    size_t nruns;
+};
+
+struct AotTable {
+    const AotImage *const *images;
+    size_t nimages;
+};
+
+// Defined by the generated code, empty in a um built without any
+extern const AotTable aot_table;
+
+// Directory to write images and profiles to for aot.py, or nullptr
+extern const char *aot_profile;
+
+/**
+ * FNV-1a over the words of an image, what translations are looked up by.
+**/
+static inline uint64_t aot_hash(const reg_t *data, reg_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(reg_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+reg_t aot_new(AotState &s, reg_t size);
+void aot_del(AotState &s, reg_t ident);
+void aot_stale(AotState &s, uint32_t run);
+void aot_check_arrays(void *s);
+
+static inline bool aot_lda(const AotState &s, reg_t &out, reg_t b, reg_t c) {
+    if(b >= s.narrays) return false;
+    const AotArray &array = s.arrays[b];
+    if(array.data == nullptr || c >= array.size) return false;
+    out = array.data[c];
+    return true;
+}
+
+/**
+ * Returns 0 if it stored, 1 for ERR_ARR or 2 if it changed a translated word.
+**/
+static inline int aot_sta(AotState &s, reg_t a, reg_t b, reg_t c) {
+    if(a >= s.narrays) return 1;
+    AotArray &array = s.arrays[a];
+    if(array.data == nullptr || b >= array.size) return 1;
+
+    if(a == 0 && b < s.owned && s.owner[b] && array.data[b] != c) {
+        array.data[b] = c;
+        aot_stale(s, s.owner[b]);
+        return 2;
+    }
+    array.data[b] = c;
+    return 0;
+}
+
+/**
+ * What aot.py emits, one macro per instruction with its address (p) and
+ * register numbers. A function holding the labels for entries FIRST to
+ * FIRST + N - 1 is
+ *
+ *   AotExit chunk_K(AotState &s) {
+ *       static void *const labels[] = {&&L10, &&L14, ...};
+ *       AOT_ENTER(FIRST);
+ *   L10: AOT_ADD(3, 1, 2)
+ *       ...
+ *       AOT_PRG(13, 0xc0000031u, 6, 1)
+ *       AOT_DISPATCH(FIRST, N, r1);
+ *   L14: ...
+ *   }
+ *
+ * Every instruction counts itself in steps like the interpreters do, the
+ * increments within a run fold into one.
+**/
+#define AOT_ENTER(first) \
+    reg_t r0 = s.registers[0], r1 = s.registers[1], r2 = s.registers[2], \
+        r3 = s.registers[3], r4 = s.registers[4], r5 = s.registers[5], \
+        r6 = s.registers[6], r7 = s.registers[7]; \
+    uint64_t steps = s.steps; \
+    goto *labels[s.label[s.pc] - 1 - (first)]
+
+#define AOT_SPILL() do { \
+    s.registers[0] = r0; s.registers[1] = r1; s.registers[2] = r2; \
+    s.registers[3] = r3; s.registers[4] = r4; s.registers[5] = r5; \
+    s.registers[6] = r6; s.registers[7] = r7; \
+    s.steps = steps; \
+} while(0)
+
+#define AOT_STOP(err, next) do { \
+    AOT_SPILL(); s.pc = (next); s.error = (err); return EXIT_STOP; \
+} while(0)
+
+#define AOT_JUMP(next) do { \
+    AOT_SPILL(); s.pc = (next); return EXIT_JUMP; \
+} while(0)
+
+/**
+ * Jump to the label for target if it's one of this function's and still live,
+ * otherwise leave it to aot_run.
+**/
+#define AOT_DISPATCH(first, n, target) do { \
+    reg_t e = (target) < s.owned? s.label[target] - 1 - (first) : (n); \
+    if(e < (n)) goto *labels[e]; \
+    AOT_JUMP(target); \
+} while(0)
+
+#define AOT_MOV(a, b, c) ++steps; if(r##c) r##a = r##b;
+#define AOT_ADD(a, b, c) ++steps; r##a = r##b + r##c;
+#define AOT_MUL(a, b, c) ++steps; r##a = r##b * r##c;
+#define AOT_NAN(a, b, c) ++steps; r##a = ~(r##b & r##c);
+#define AOT_LDI(a, n) ++steps; r##a = (n);
+
+#define AOT_DIV(p, a, b, c) ++steps; \
+    if(r##c == 0) AOT_STOP(ERR_DIV, (p) + 1); \
+    r##a = r##b / r##c;
+
+#define AOT_LDA(p, a, b, c) ++steps; \
+    if(!aot_lda(s, r##a, r##b, r##c)) AOT_STOP(ERR_ARR, (p) + 1);
+
+#define AOT_STA(p, a, b, c) ++steps; \
+    switch(aot_sta(s, r##a, r##b, r##c)) { \
+        case 1: AOT_STOP(ERR_ARR, (p) + 1); \
+        case 2: AOT_JUMP((p) + 1); \
+    }
+
+#define AOT_HLT(p) ++steps; AOT_STOP(ERR_OK, (p) + 1);
+#define AOT_INV(p) ++steps; AOT_STOP(ERR_INV, (p) + 1);
+
+#define AOT_NEW(b, c) ++steps; r##b = aot_new(s, r##c);
+
+#define AOT_DEL(p, c) ++steps; \
+    if(r##c == 0) AOT_STOP(ERR_DEL, (p) + 1); \
+    aot_del(s, r##c);
+
+#define AOT_OUT(p, c) ++steps; \
+    if(r##c > 0xff) AOT_STOP(ERR_CHR, (p) + 1); \
+    output_putc(r##c);
+
+#define AOT_INP(c) ++steps; r##c = input_getc(steps);
+
+/**
+ * Followed by AOT_DISPATCH for a prg 0.
+**/
+#define AOT_PRG(p, cur, b, c) ++steps; \
+    PERF_CHECK(steps); \
+    if(steps >= check_next) { \
+        AOT_SPILL(); \
+        check_point(steps, (p) + 1, cur, s.registers, aot_check_arrays, &s); \
+    } \
+    if(r##b) { \
+        AOT_SPILL(); s.pc = (p) + 1; s.ident = r##b; s.target = r##c; \
+        return EXIT_LOAD; \
+    }
+
+#endif
@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+"""
+Ahead-of-time translator for --engine=aot, `make aot` runs it.
+
+Reads the images and profiles `um --engine=aot --aot-profile DIR` leaves in
+DIR (HASH.um and HASH.txt, see aot.cpp) and writes a C++ file per image plus
+table.cpp listing them, which um is then rebuilt with. Only the words the
+profile says were executed are translated. They're split into runs of
+straight-line code ending at a prg, hlt or invalid instruction, with a label at
+the start of each and at every address a prg landed on, and consecutive runs
+are put in the same function up to CHUNK words. A prg 0 to a label in the same
+function is a computed goto, anything else goes back to aot_run (see aot.h).
+
+Output files for images that are no longer in DIR are removed, so with no
+profiles at all this leaves an empty table.
+"""
+
+import os
+import sys
+from glob import glob
+
+from um import MAX_IMM
+
+OP_HLT, OP_PRG, OP_LDI = 7, 12, 13
+
+# Words of code per generated function. Jumps within one are gotos, bigger
+# ones take longer to compile
+CHUNK = 4096
+
+def fnv1a(words: list[int]):
+    """aot_hash in aot.h."""
+    h = 0xcbf29ce484222325
+    for word in words:
+        h = ((h ^ word) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+def load_image(path: str):
+    with open(path, "rb") as f:
+        data = f.read()
+    return [
+        int.from_bytes(data[i:i + 4], "big")
+        for i in range(0, len(data) - 3, 4)
+    ]
+
+def load_profile(path: str):
+    """Union of every run recorded, as sets of executed and jumped to pcs."""
+    executed: set[int] = set()
+    jumped: set[int] = set()
+    with open(path) as f:
+        for line in f:
+            match line.split():
+                case ["run", start, end]:
+                    executed.update(range(int(start), int(end)))
+                case ["jump", pc]:
+                    jumped.add(int(pc))
+    return executed, jumped
+
+def is_terminator(word: int):
+    op = word >> 28
+    return op == OP_HLT or op == OP_PRG or op > OP_LDI
+
+def split_runs(words: list[int], executed: set[int]):
+    """[start, end) of every stretch of straight-line code."""
+    runs: list[tuple[int, int]] = []
+    start = None
+    for pc in range(len(words) + 1):
+        if pc < len(words) and pc in executed:
+            if start is None:
+                start = pc
+            if is_terminator(words[pc]):
+                runs.append((start, pc + 1))
+                start = None
+        elif start is not None:
+            runs.append((start, pc))
+            start = None
+    return runs
+
+def translate(p: int, word: int, first: int, n: int):
+    """Lines of C++ for the instruction at p."""
+    op = word >> 28
+    a, b, c = (word >> 6) & 7, (word >> 3) & 7, word & 7
+    match op:
+        case 0: return [f"AOT_MOV({a}, {b}, {c})"]
+        case 1: return [f"AOT_LDA({p}, {a}, {b}, {c})"]
+        case 2: return [f"AOT_STA({p}, {a}, {b}, {c})"]
+        case 3: return [f"AOT_ADD({a}, {b}, {c})"]
+        case 4: return [f"AOT_MUL({a}, {b}, {c})"]
+        case 5: return [f"AOT_DIV({p}, {a}, {b}, {c})"]
+        case 6: return [f"AOT_NAN({a}, {b}, {c})"]
+        case 7: return [f"AOT_HLT({p})"]
+        case 8: return [f"AOT_NEW({b}, {c})"]
+        case 9: return [f"AOT_DEL({p}, {c})"]
+        case 10: return [f"AOT_OUT({p}, {c})"]
+        case 11: return [f"AOT_INP({c})"]
+        case 12: return [
+            f"AOT_PRG({p}, {word:#010x}u, {b}, {c})",
+            f"AOT_DISPATCH({first}, {n}, r{c});"
+        ]
+        case 13:
+            return [f"AOT_LDI({(word >> 25) & 7}, {word & MAX_IMM:#x}u)"]
+        case _: return [f"AOT_INV({p})"]
+
+def chunk_runs(runs: list[tuple[int, int]]):
+    """Consecutive runs grouped into functions of about CHUNK words."""
+    chunks: list[list[tuple[int, int]]] = []
+    size = CHUNK
+    for run in runs:
+        if size + run[1] - run[0] > CHUNK:
+            chunks.append([])
+            size = 0
+        chunks[-1].append(run)
+        size += run[1] - run[0]
+    return chunks
+
+def generate(name: str, words: list[int], executed: set[int], jumped: set[int]):
+    runs = split_runs(words, executed)
+    out = [
+        f"// Generated by aot.py from {name}.um, do not edit",
+        '#include "aot.h"',
+        "",
+        "namespace {",
+        "",
+    ]
+    entries: list[tuple[int, int]] = []
+
+    for k, chunk in enumerate(chunk_runs(runs)):
+        labels = sorted(
+            {start for start, _ in chunk}
+            | {pc for start, end in chunk for pc in jumped if start <= pc < end}
+        )
+        first, n = len(entries), len(labels)
+        entries += [(pc, k) for pc in labels]
+
+        out.append(f"AotExit chunk_{k}(AotState &s) {{")
+        out.append("    static void *const labels[] = {")
+        out += [f"        &&L{pc}," for pc in labels]
+        out.append("    };")
+        out.append(f"    AOT_ENTER({first});")
+        targets = set(labels)
+        for start, end in chunk:
+            for pc in range(start, end):
+                if pc in targets:
+                    out.append(f"L{pc}:")
+                out += ["    " + line for line in translate(pc, words[pc], first, n)]
+            if not is_terminator(words[end - 1]):
+                out.append(f"    AOT_JUMP({end}u);")
+        out.append("}")
+        out.append("")
+
+    out.append("const AotEntry entries[] = {")
+    out += [f"    {{{pc}, chunk_{k}}}," for pc, k in entries]
+    out.append("};")
+    out.append("")
+    out.append("const AotRange runs[] = {")
+    out += [f"    {{{start}, {end}}}," for start, end in runs]
+    out.append("};")
+    out.append("")
+    out.append("}")
+    out.append("")
+    out.append(f"extern const AotImage aot_image_{name} = {{")
+    out.append(f"    {len(words)}, 0x{name}ull,")
+    out.append(f"    entries, {len(entries)}, runs, {len(runs)}")
+    out.append("};")
+    return "\n".join(out) + "\n"
+
+def write_if_changed(path: str, text: str):
+    """Leave files alone if they'd be the same so make doesn't rebuild them."""
+    try:
+        with open(path) as f:
+            if f.read() == text:
+                return
+    except FileNotFoundError:
+        pass
+    with open(path, "w") as f:
+        f.write(text)
+
+def main(*argv):
+    if len(argv) != 3:
+        print(f"Usage: {argv[0]} <output dir> <profile dir>")
+        return 1
+    out_dir, profile_dir = argv[1:]
+    os.makedirs(out_dir, exist_ok=True)
+
+    names: list[str] = []
+    for path in sorted(glob(os.path.join(profile_dir, "*.txt"))):
+        name = os.path.basename(path)[:-4]
+        image = os.path.join(profile_dir, name + ".um")
+        if not os.path.exists(image):
+            continue
+
+        words = load_image(image)
+        if f"{fnv1a(words):016x}" != name:
+            print(f"{image} doesn't match its hash, skipping", file=sys.stderr)
+            continue
+        executed, jumped = load_profile(path)
+        if not executed:
+            continue
+
+        names.append(name)
+        write_if_changed(
+            os.path.join(out_dir, name + ".cpp"),
+            generate(name, words, executed, jumped)
+        )
+        print(f"{name}: {len(executed)} of {len(words)} words", file=sys.stderr)
+
+    for path in glob(os.path.join(out_dir, "*.cpp")):
+        name = os.path.basename(path)[:-4]
+        if name != "table" and name not in names:
+            os.remove(path)
+
+    table = [
+        "// Generated by aot.py, do not edit",
+        '#include "aot.h"',
+        "",
+    ]
+    table += [f"extern const AotImage aot_image_{name};" for name in names]
+    if names:
+        table.append("")
+        table.append("static const AotImage *const images[] = {")
+        table += [f"    &aot_image_{name}," for name in names]
+        table.append("};")
+        table.append("")
+        table.append(f"const AotTable aot_table = {{images, {len(names)}}};")
+    else:
+        table.append("const AotTable aot_table = {nullptr, 0};")
+    write_if_changed(os.path.join(out_dir, "table.cpp"), "\n".join(table) + "\n")
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(*sys.argv))
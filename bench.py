@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+"""
+Benchmark suite for the engines in ./um, `make bench` runs it.
+
+Every workload is run against every engine a few times, each in a fresh
+process so peak RSS is per run. Wall time is measured around the whole process
+(including loading the program), instructions and the engine's own time come
+from the summary line `um --stats` prints. Results go to a JSON file so runs
+can be compared over time.
+
+With --micro it runs the per-opcode programs from bench/*.uma instead (built
+into build/bench/ by `make microbench`), each of which stresses one operation
+in a tight loop, and reports nanoseconds per instruction.
+"""
+
+import json
+import os
+import platform
+import re
+import statistics
+import subprocess
+import sys
+import threading
+import time
+from glob import glob
+from typing import Optional
+
+ENGINES = ["try", "try4", "trap", "aot", "jit", "cnp", "hw1c", "hw1"]
+
+# name: (program, scripted input or None)
+WORKLOADS: dict[str, tuple[str, Optional[str]]] = {
+    "sandmark": ("test/sandmark.um", None),
+    "factorial-0": ("test/factorial-program-0.um", "test/factorial-0.txt"),
+    "factorial-10": ("test/factorial-program-10.um", "test/factorial-10.txt"),
+    "fizzbuzz": ("test/fizzbuzz.um", None),
+    "umix-guest": ("test/umix.um", "test/umix-guest.txt"),
+    "umix-hack": ("test/umix.um", "test/umix-hack.txt"),
+}
+
+MICRO_DIR = "build/bench"
+
+STATSRE = re.compile(
+    r"^(?P<engine>\w+): (?P<status>\w+), (?P<steps>\d+) instructions "
+    r"in (?P<seconds>[\d.]+)s", re.MULTILINE
+)
+
+def run_once(
+    um: str, engine: str, program: str, script: Optional[str], timeout: float
+):
+    """Run one workload, returning wall seconds, peak RSS and the stats line."""
+    argv = [um, f"--engine={engine}", "--stats"]
+    if script:
+        argv += ["--input", script]
+    argv.append(program)
+
+    start = time.perf_counter()
+    proc = subprocess.Popen(
+        argv, stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+        stderr=subprocess.PIPE
+    )
+    # Some engines loop forever on some workloads (hw1 on umix)
+    killer = threading.Timer(timeout, proc.kill)
+    killer.start()
+    stderr = proc.stderr.read().decode(errors="replace")
+    proc.stderr.close()
+    # wait4 gives the rusage of this child alone, unlike RUSAGE_CHILDREN
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.perf_counter() - start
+    killer.cancel()
+    proc.returncode = os.waitstatus_to_exitcode(status)
+
+    if (m := STATSRE.search(stderr)) is None:
+        status = "TIMEOUT" if wall >= timeout else "CRASH"
+        return {"wall": wall, "rss_kb": usage.ru_maxrss, "status": status}
+
+    return {
+        "wall": wall,
+        "rss_kb": usage.ru_maxrss, # Kilobytes on Linux
+        "status": m["status"],
+        "steps": int(m["steps"]),
+        "seconds": float(m["seconds"]),
+    }
+
+def summarize(samples: list[float]):
+    mean = statistics.fmean(samples)
+    stdev = statistics.stdev(samples) if len(samples) > 1 else 0.0
+    return {
+        "mean": mean,
+        "median": statistics.median(samples),
+        "min": min(samples),
+        "max": max(samples),
+        "stdev": stdev,
+        "cv": stdev / mean if mean else 0.0, # Run-to-run variance, relative
+        "samples": samples,
+    }
+
+def micro_workloads():
+    return {
+        os.path.basename(path).removesuffix(".um"): (path, None)
+        for path in sorted(glob(f"{MICRO_DIR}/*.um"))
+    }
+
+def bench(
+    um: str, engines: list[str], suite: dict[str, tuple[str, Optional[str]]],
+    workloads: list[str], reps: int, micro: bool, timeout: float
+):
+    results = []
+    for name in workloads:
+        program, script = suite[name]
+        for engine in engines:
+            runs = []
+            for _ in range(reps):
+                runs.append(run_once(um, engine, program, script, timeout))
+                if runs[-1]["status"] == "TIMEOUT":
+                    break # Not worth waiting for again
+            statuses = {r["status"] for r in runs}
+            status = statuses.pop() if len(statuses) == 1 else "FLAKY"
+
+            result = {
+                "engine": engine,
+                "workload": name,
+                "status": status,
+                "reps": reps,
+                "wall": summarize([r["wall"] for r in runs]),
+                "peak_rss_kb": max(r["rss_kb"] for r in runs),
+            }
+            if status == "OK":
+                steps = runs[0]["steps"]
+                result["instructions"] = steps
+                result["engine_time"] = summarize([r["seconds"] for r in runs])
+                result["mips"] = summarize([
+                    steps / r["seconds"] / 1e6 if r["seconds"] else 0.0
+                    for r in runs
+                ])
+                result["ns_per_instruction"] = summarize([
+                    r["seconds"] / steps * 1e9 for r in runs
+                ])
+
+            results.append(result)
+            line = f"{name:>14} {engine:>5}: {status:>5}"
+            if status == "OK" and micro:
+                ns = result["ns_per_instruction"]
+                line += f" {ns['median']:7.3f} ns/instr ±{ns['cv']*100:4.1f}%"
+            elif status == "OK":
+                wall = result["wall"]
+                line += (
+                    f" {wall['median']:8.3f}s ±{wall['cv']*100:4.1f}%"
+                    f" {result['mips']['median']:8.1f} MIPS"
+                    f" {result['peak_rss_kb']/1024:7.1f} MB"
+                )
+            print(line, file=sys.stderr)
+
+    return results
+
+def machine_info():
+    info = {
+        "host": platform.node(),
+        "system": platform.platform(),
+        "cpus": os.cpu_count(),
+    }
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    info["cpu"] = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    try:
+        info["commit"] = subprocess.run(
+            ["git", "rev-parse", "--short", "HEAD"],
+            capture_output=True, text=True, check=True
+        ).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        pass
+    return info
+
+def main(*argv):
+    um = "./um"
+    out = "bench.json"
+    reps = 3
+    engines = ENGINES
+    suite = WORKLOADS
+    workloads = None
+    micro = False
+    timeout = 300.0
+
+    args = list(argv[1:])
+    while args:
+        match args.pop(0):
+            case "--um": um = args.pop(0)
+            case "--out": out = args.pop(0)
+            case "--reps": reps = int(args.pop(0))
+            case "--timeout": timeout = float(args.pop(0))
+            case "--micro":
+                micro = True
+                suite = micro_workloads()
+            case "--engines":
+                if (arg := args.pop(0)) != "all":
+                    engines = arg.split(",")
+            case "--workloads":
+                if (arg := args.pop(0)) != "all":
+                    workloads = arg.split(",")
+            case _:
+                print(f"Usage: python {argv[0]} [--um PATH] [--out FILE] [--reps N] [--micro]")
+                print("    [--timeout SECONDS]")
+                print("    [--engines A,B,...|all] [--workloads A,B,...|all]")
+                print(f"Workloads: {' '.join(WORKLOADS)}")
+                return 1
+
+    if not suite:
+        print(f"No programs in {MICRO_DIR}, run make microbench", file=sys.stderr)
+        return 1
+    if workloads is None:
+        workloads = list(suite)
+    for name in workloads:
+        if name not in suite:
+            print(f"Unknown workload {name}", file=sys.stderr)
+            return 1
+
+    report = {
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "machine": machine_info(),
+        # What was asked for, so compare.py knows which pairs were left out
+        "engines": engines,
+        "workloads": workloads,
+        "results": bench(um, engines, suite, workloads, reps, micro, timeout),
+    }
+    with open(out, "w") as f:
+        json.dump(report, f, indent=2)
+        f.write("\n")
+
+    print(f"Wrote {out}", file=sys.stderr)
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(*sys.argv))
@@ -0,0 +1,480 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <ctime>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "io.h"
+
+#define RUNNING (-1) // Error of a checkpoint which isn't the end of the run
+#define NARROW 256 // Checkpoints per divergent span when narrowing it down
+#define MAX_LISTED 8 // Differing arrays to print
+#define STALL_SECONDS 10 // Minimum wait for the engine to catch up
+#define STALL_FACTOR 20 // Or this many times as long as the reference took
+
+/**
+ * Fixed part of a checkpoint as it goes down the pipe, followed by narrays
+ * ArrayHash.
+**/
+struct Record {
+    uint64_t steps;
+    uint64_t hash; // Of the array list
+    int32_t error; // RUNNING or how the run ended
+    reg_t pc;
+    reg_t cur; // Instruction the checkpoint was taken at
+    reg_t narrays;
+    reg_t has_state; // Zero if registers and arrays are unknown
+    reg_t registers[8];
+};
+
+struct ArrayHash {
+    reg_t ident;
+    reg_t size;
+    uint64_t hash;
+};
+
+struct Checkpoint {
+    Record head;
+    ArrayHash *arrays;
+    reg_t capacity;
+
+    void reserve(reg_t n) {
+        if(n <= capacity) return;
+        while(capacity < n) capacity = capacity? capacity * 2 : 256;
+        arrays = (ArrayHash *)std::realloc(arrays, capacity * sizeof(ArrayHash));
+    }
+
+    void push(const ArrayHash &array) {
+        reserve(head.narrays + 1);
+        arrays[head.narrays++] = array;
+    }
+};
+
+uint64_t check_next = UINT64_MAX;
+int check_enabled = 0;
+
+// Child side, where checkpoints go and when to take them
+static int check_fd = -1;
+static uint64_t check_from, check_interval;
+static Checkpoint taking;
+
+#define FNV_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t mix(uint64_t h, uint64_t word) {
+    return (h ^ word) * FNV_PRIME;
+}
+
+void check_array(reg_t ident, const reg_t *data, reg_t size) {
+    // Engines disagree on whether an empty array is active (try.cpp can't
+    // tell), and nothing can tell from inside the UM either
+    if(size == 0) return;
+
+    uint64_t h = FNV_BASIS;
+    if(data) {
+        for(reg_t i = 0; i < size; ++i) h = mix(h, data[i]);
+    }
+    else {
+        h = 0;
+    }
+    taking.push({ident, size, h});
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while(len) {
+        ssize_t n = write(fd, p, len);
+        if(n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while(len) {
+        ssize_t n = read(fd, p, len);
+        if(n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void take(
+    uint64_t steps, int32_t error, reg_t pc, reg_t cur,
+    const reg_t *registers, CheckArrays arrays, void *vm
+) {
+    Record &head = taking.head;
+    head.steps = steps;
+    head.error = error;
+    head.pc = pc;
+    head.cur = cur;
+    head.narrays = 0;
+    head.has_state = registers != nullptr;
+    if(registers) {
+        std::memcpy(head.registers, registers, sizeof(head.registers));
+    }
+    else {
+        std::memset(head.registers, 0, sizeof(head.registers));
+    }
+    if(arrays) arrays(vm);
+
+    uint64_t h = FNV_BASIS;
+    for(reg_t i = 0; i < head.narrays; ++i) {
+        h = mix(mix(mix(h, taking.arrays[i].ident), taking.arrays[i].size),
+            taking.arrays[i].hash);
+    }
+    head.hash = h;
+
+    // The parent kills us once it's seen enough, so failing here is expected
+    if(!write_all(check_fd, &head, sizeof(head))
+        || !write_all(check_fd, taking.arrays, head.narrays * sizeof(ArrayHash))) {
+        _exit(0);
+    }
+}
+
+void check_point(
+    uint64_t steps, reg_t pc, reg_t cur, const reg_t *registers,
+    CheckArrays arrays, void *vm
+) {
+    take(steps, RUNNING, pc, cur, registers, arrays, vm);
+    // The next interval boundary, but at least the next OP_PRG
+    uint64_t next = check_from
+        + ((steps - check_from) / check_interval + 1) * check_interval;
+    check_next = next > steps? next : steps + 1;
+}
+
+void check_done(
+    uint64_t steps, Error error, reg_t pc, const reg_t *registers,
+    CheckArrays arrays, void *vm
+) {
+    take(steps, error, pc, 0, registers, arrays, vm);
+}
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool readable(int fd, double seconds) {
+    pollfd p = {fd, POLLIN, 0};
+    return poll(&p, 1, (int)(seconds * 1000)) > 0;
+}
+
+static bool read_checkpoint(int fd, Checkpoint &point) {
+    if(!read_all(fd, &point.head, sizeof(point.head))) return false;
+
+    point.reserve(point.head.narrays);
+    return read_all(fd, point.arrays, point.head.narrays * sizeof(ArrayHash));
+}
+
+/**
+ * Run an engine in a child which writes its checkpoints to the returned pid's
+ * pipe in *fd. Only the engine under test on the first pass gets to print.
+**/
+static pid_t spawn(
+    Engine run, const reg_t *prog, reg_t size,
+    uint64_t from, uint64_t interval, bool quiet, int *fd
+) {
+    int pipefd[2];
+    if(pipe(pipefd)) return -1;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if(pid < 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if(pid > 0) {
+        close(pipefd[1]);
+        *fd = pipefd[0];
+        return pid;
+    }
+
+    // Don't outlive the checker if it's interrupted
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    close(pipefd[0]);
+    if(quiet) {
+        int null = open("/dev/null", O_WRONLY);
+        if(null >= 0) dup2(null, STDOUT_FILENO);
+    }
+    check_fd = pipefd[1];
+    check_enabled = 1;
+    check_from = from;
+    check_interval = interval;
+    check_next = from;
+
+    if(io_begin()) _exit(1);
+    uint64_t steps = 0;
+    run(prog, size, &steps);
+    io_finish(steps);
+    _exit(0);
+}
+
+static bool same(const Checkpoint &a, const Checkpoint &b) {
+    const Record &x = a.head, &y = b.head;
+    if(x.steps != y.steps || x.error != y.error || x.pc != y.pc) return false;
+    if(!x.has_state || !y.has_state) return true;
+    return x.hash == y.hash && x.narrays == y.narrays
+        && std::memcmp(x.registers, y.registers, sizeof(x.registers)) == 0;
+}
+
+enum PassResult {
+    PASS_FAILED = -1,
+    PASS_AGREED,
+    PASS_DIVERGED
+};
+
+struct Pass {
+    Checkpoint ref, eng; // Last checkpoints read, which differ if diverged
+    bool ref_ok, eng_ok; // Whether they were read or the pipe was closed
+    bool stalled; // The engine didn't catch up with the reference
+    int ref_status, eng_status; // From waitpid
+    double waited;
+    bool matched; // Whether there was a matching checkpoint before
+    Record last; // The last matching checkpoint
+    uint64_t checkpoints;
+};
+
+static PassResult run_pass(
+    Engine reference, Engine engine, const reg_t *prog, reg_t size,
+    uint64_t from, uint64_t interval, bool quiet, Pass &pass
+) {
+    int ref_fd, eng_fd;
+    pid_t ref = spawn(reference, prog, size, from, interval, true, &ref_fd);
+    if(ref < 0) return PASS_FAILED;
+    pid_t eng = spawn(engine, prog, size, from, interval, quiet, &eng_fd);
+    if(eng < 0) {
+        kill(ref, SIGKILL);
+        waitpid(ref, nullptr, 0);
+        close(ref_fd);
+        return PASS_FAILED;
+    }
+
+    pass.matched = false;
+    pass.checkpoints = 0;
+    PassResult result;
+    for(;;) {
+        // An engine stuck inside one instruction never reaches another
+        // checkpoint, so it only gets so long after the reference does
+        double start = now();
+        pass.ref_ok = read_checkpoint(ref_fd, pass.ref);
+        pass.waited = STALL_FACTOR * (now() - start);
+        if(pass.waited < STALL_SECONDS) pass.waited = STALL_SECONDS;
+        pass.stalled = pass.ref_ok && !readable(eng_fd, pass.waited);
+        pass.eng_ok = !pass.stalled && read_checkpoint(eng_fd, pass.eng);
+        if(!pass.ref_ok || !pass.eng_ok || !same(pass.ref, pass.eng)) {
+            result = PASS_DIVERGED;
+            break;
+        }
+
+        ++pass.checkpoints;
+        if(pass.ref.head.error != RUNNING) {
+            result = PASS_AGREED;
+            break;
+        }
+        pass.matched = true;
+        pass.last = pass.ref.head;
+    }
+
+    // Whatever's left of either run doesn't matter any more
+    kill(ref, SIGKILL);
+    kill(eng, SIGKILL);
+    close(ref_fd);
+    close(eng_fd);
+    waitpid(ref, &pass.ref_status, 0);
+    waitpid(eng, &pass.eng_status, 0);
+    return result;
+}
+
+static const char *mnemonics[16] = {
+    "mov", "lda", "sta", "add", "mul", "div", "nan", "hlt",
+    "new", "del", "out", "inp", "prg", "ldi", "x14", "x15"
+};
+
+/**
+ * The instruction a checkpoint was taken at, in um.py's assembly syntax.
+**/
+static void print_instruction(char *buf, size_t len, const Record &r) {
+    if(r.error != RUNNING) {
+        snprintf(buf, len, "(end)");
+    }
+    else if(OPCODE(r.cur) == OP_LDI) {
+        snprintf(buf, len, "ldi %u %u", (r.cur >> 25) & 7, r.cur & 0x01ffffff);
+    }
+    else {
+        snprintf(buf, len, "%s %u %u %u", mnemonics[OPCODE(r.cur)],
+            RX(2, r.cur), RX(1, r.cur), RX(0, r.cur)
+        );
+    }
+}
+
+static const char *status(const Record &r) {
+    return r.error == RUNNING? "running" : errname((Error)r.error);
+}
+
+static void print_divergence(
+    const char *ref_name, const char *eng_name, const Pass &pass
+) {
+    if(pass.matched) {
+        fprintf(stderr,
+            "  last match at %" PRIu64 " instructions, the prg at pc %u\n",
+            pass.last.steps, pass.last.pc - 1
+        );
+    }
+    else {
+        fprintf(stderr, "  no checkpoint matched\n");
+    }
+
+    const Record &x = pass.ref.head, &y = pass.eng.head;
+    char xi[32], yi[32];
+    print_instruction(xi, sizeof(xi), x);
+    print_instruction(yi, sizeof(yi), y);
+
+    if(pass.stalled) {
+        fprintf(stderr,
+            "  %s reached %" PRIu64 " instructions (%s at pc %u) but %s "
+            "didn't within %.0fs, it's stuck or pathologically slow\n",
+            ref_name, x.steps, xi, x.pc - 1, eng_name, pass.waited
+        );
+        return;
+    }
+    if(!pass.ref_ok || !pass.eng_ok) {
+        const char *name = pass.ref_ok? eng_name : ref_name;
+        int status = pass.ref_ok? pass.eng_status : pass.ref_status;
+        if(WIFSIGNALED(status)) {
+            fprintf(stderr, "  %s crashed (%s) after the last match\n",
+                name, strsignal(WTERMSIG(status)));
+        }
+        else {
+            fprintf(stderr, "  %s exited without finishing the run\n", name);
+        }
+        return;
+    }
+
+    #define ROW(name, fmt, a, b, differ) fprintf(stderr, \
+        "  %-14s " fmt "  " fmt "%s\n", name, a, b, (differ)? "  <<" : "")
+
+    fprintf(stderr, "  %-14s %16s  %16s\n", "", ref_name, eng_name);
+    ROW("instructions", "%16" PRIu64, x.steps, y.steps, x.steps != y.steps);
+    ROW("next pc", "%16u", x.pc, y.pc, x.pc != y.pc);
+    ROW("at", "%16s", xi, yi, x.cur != y.cur);
+    ROW("status", "%16s", status(x), status(y), x.error != y.error);
+    if(!x.has_state || !y.has_state) return;
+
+    for(int i = 0; i < 8; ++i) {
+        char name[8];
+        snprintf(name, sizeof(name), "r%d", i);
+        ROW(name, "%16u", x.registers[i], y.registers[i],
+            x.registers[i] != y.registers[i]);
+    }
+    ROW("arrays", "%16u", x.narrays, y.narrays, x.narrays != y.narrays);
+
+    #undef ROW
+
+    // Both lists are sorted by identifier, list what's different
+    const Checkpoint &a = pass.ref, &b = pass.eng;
+    reg_t i = 0, j = 0;
+    int listed = 0;
+    while((i < x.narrays || j < y.narrays) && listed < MAX_LISTED) {
+        const ArrayHash *p = i < x.narrays? &a.arrays[i] : nullptr;
+        const ArrayHash *q = j < y.narrays? &b.arrays[j] : nullptr;
+        if(p && (!q || p->ident < q->ident)) {
+            fprintf(stderr, "  array %u (size %u) only in %s\n",
+                p->ident, p->size, ref_name);
+            ++i;
+            ++listed;
+        }
+        else if(q && (!p || q->ident < p->ident)) {
+            fprintf(stderr, "  array %u (size %u) only in %s\n",
+                q->ident, q->size, eng_name);
+            ++j;
+            ++listed;
+        }
+        else {
+            if(p->size != q->size) {
+                fprintf(stderr, "  array %u size %u vs %u\n",
+                    p->ident, p->size, q->size);
+                ++listed;
+            }
+            else if(p->hash != q->hash) {
+                fprintf(stderr, "  array %u (size %u) contents differ\n",
+                    p->ident, p->size);
+                ++listed;
+            }
+            ++i;
+            ++j;
+        }
+    }
+    if(listed == MAX_LISTED) fprintf(stderr, "  ...\n");
+}
+
+int check_run(
+    Engine reference, const char *reference_name,
+    Engine engine, const char *engine_name,
+    const reg_t *prog, reg_t size, uint64_t interval
+) {
+    if(interval == 0) interval = 1;
+
+    Pass pass = {};
+    uint64_t from = 0;
+    bool quiet = false;
+    for(;;) {
+        PassResult result = run_pass(
+            reference, engine, prog, size, from, interval, quiet, pass
+        );
+        if(result == PASS_FAILED) {
+            perror("Failed to start checked engines");
+            return -1;
+        }
+        if(result == PASS_AGREED) {
+            fprintf(stderr,
+                "check: %s matches %s, %" PRIu64 " checkpoints over %"
+                PRIu64 " instructions (%s)\n",
+                engine_name, reference_name, pass.checkpoints,
+                pass.ref.head.steps, status(pass.ref.head)
+            );
+            return 0;
+        }
+        // Rerunning a stall only finds the same stall sooner, if at all
+        if(interval == 1 || pass.stalled) break;
+
+        // Rerun from the last match with checkpoints closer together. An
+        // engine which stopped early bounds the span as well.
+        uint64_t end = UINT64_MAX;
+        if(pass.ref_ok) end = pass.ref.head.steps;
+        if(pass.eng_ok && pass.eng.head.steps < end) end = pass.eng.head.steps;
+        from = pass.matched? pass.last.steps : 0;
+        uint64_t span = end == UINT64_MAX? interval : end - from;
+        uint64_t next = span / NARROW;
+        // A long block can keep the span from shrinking, make sure it ends
+        interval = next < interval? next : interval / 2;
+        if(interval == 0) interval = 1;
+        quiet = true;
+        fprintf(stderr,
+            "check: diverged before %" PRIu64 " instructions, "
+            "rechecking from %" PRIu64 " every %" PRIu64 "\n",
+            end, from, interval
+        );
+    }
+
+    fprintf(stderr, "check: %s %s %s\n",
+        engine_name, pass.stalled? "fell behind" : "diverged from", reference_name
+    );
+    print_divergence(reference_name, engine_name, pass);
+    return 1;
+}
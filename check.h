@@ -0,0 +1,86 @@
+/**
+ * Differential checking for --check. The engine under test and the reference
+ * engine each run in their own child process and stream checkpoints of their
+ * state to the parent, which compares them in lockstep and stops at the first
+ * one that doesn't match. Kept C-compatible so hw1.c can take part.
+ *
+ * A checkpoint is taken in OP_PRG, before it executes, once the instruction
+ * count passes check_next: the registers, the pc, the instruction itself and a
+ * hash of every non-empty array. OP_PRG is the only jump, so at an interval of
+ * 1 that's every basic block boundary. The end of the run is always a
+ * checkpoint too, with the error it ended with.
+**/
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdint.h>
+
+#include "um.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Instruction count of the next checkpoint, never reached unless checking
+extern uint64_t check_next;
+// Non-zero in a process being checked, so the end of the run is reported
+extern int check_enabled;
+
+/**
+ * Engine specific walk over its arrays, calling check_array for each active
+ * one in ascending identifier order.
+**/
+typedef void (*CheckArrays)(void *vm);
+
+/**
+ * Slow path of CHECK_POINT, sends the state to the parent and advances
+ * check_next.
+**/
+void check_point(
+    uint64_t steps, reg_t pc, reg_t cur, const reg_t *registers,
+    CheckArrays arrays, void *vm
+);
+
+/**
+ * Add an array to the checkpoint being taken. data may be NULL if the engine
+ * can't say what's in it, which never matches.
+**/
+void check_array(reg_t ident, const reg_t *data, reg_t size);
+
+/**
+ * Report the end of the run. registers and arrays may be NULL if the engine
+ * lost its state (trap.cpp after a signal), only the count, pc and error are
+ * compared then.
+**/
+void check_done(
+    uint64_t steps, Error error, reg_t pc, const reg_t *registers,
+    CheckArrays arrays, void *vm
+);
+
+/**
+ * Run engine against reference, checkpointing every `interval` instructions.
+ * On a divergence it narrows down to the first basic block that differs by
+ * rerunning both from the last checkpoint that matched with smaller intervals,
+ * then prints both states to stderr. Returns 0 if they agree, 1 if they
+ * diverged or -1 if the children couldn't be started.
+**/
+int check_run(
+    Engine reference, const char *reference_name,
+    Engine engine, const char *engine_name,
+    const reg_t *prog, reg_t size, uint64_t interval
+);
+
+#define CHECK_POINT(steps, pc, cur, registers, arrays, vm) do { \
+    if((steps) >= check_next) \
+        check_point(steps, pc, cur, registers, arrays, vm); \
+} while(0)
+
+#define CHECK_DONE(steps, error, pc, registers, arrays, vm) do { \
+    if(check_enabled) check_done(steps, error, pc, registers, arrays, vm); \
+} while(0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
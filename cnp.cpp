@@ -0,0 +1,148 @@
+/**
+ * Copy-and-patch backend for the JIT (--engine=cnp), an alternative to
+ * x64.cpp for compiling traces. The machine code for each instruction comes
+ * from stencils.cpp, compiled by the same compiler at build time and cut up by
+ * stencils.py, so there's no instruction encoding here at all: a trace is the
+ * stencil of each instruction copied one after the other with its holes filled
+ * in, and the jump to the next stencil dropped when it would land right after
+ * itself anyway.
+**/
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "um.h"
+#include "jit.h"
+
+namespace {
+
+enum HoleKind {
+    ABS32, // 32-bit value
+    REL32 // 32-bit displacement from the end of the field
+};
+
+enum HoleName {
+    HOLE_A, HOLE_B, HOLE_C, HOLE_PC, HOLE_IMM, HOLE_WORD, HOLE_TARGET,
+    HOLE_SITE, HOLE_NEXT, NHOLES
+};
+
+struct Hole {
+    uint16_t offset;
+    uint8_t kind;
+    uint8_t name;
+    int32_t addend;
+};
+
+struct Stencil {
+    const uint8_t *code;
+    size_t size;
+    const Hole *holes;
+    size_t nholes;
+};
+
+#include "stencils.h"
+
+const Stencil *const stencils[16] = {
+    &STENCIL_MOV, &STENCIL_LDA, &STENCIL_STA, &STENCIL_ADD, &STENCIL_MUL,
+    &STENCIL_DIV, &STENCIL_NAN, nullptr, &STENCIL_NEW, &STENCIL_DEL,
+    &STENCIL_OUT, &STENCIL_INP, &STENCIL_PRG, &STENCIL_LDI, nullptr, nullptr
+};
+
+/**
+ * Size of a stencil once placed, without the jmp at the end when it goes to
+ * the very next byte.
+**/
+size_t placed_size(const Stencil &stencil, bool falls_through) {
+    if(!falls_through || stencil.nholes == 0) return stencil.size;
+    const Hole &last = stencil.holes[stencil.nholes - 1];
+    bool tail = last.name == HOLE_NEXT && last.kind == REL32
+        && last.offset + 4u == stencil.size
+        && stencil.code[last.offset - 1] == 0xe9;
+    return tail? stencil.size - 5 : stencil.size;
+}
+
+void place(
+    uint8_t *code, size_t at, size_t size, const Stencil &stencil,
+    const uint32_t *values
+) {
+    std::memcpy(code + at, stencil.code, size);
+    for(size_t i = 0; i < stencil.nholes; ++i) {
+        const Hole &hole = stencil.holes[i];
+        if(hole.offset >= size) continue;
+        uint32_t value = values[hole.name] + hole.addend;
+        if(hole.kind == REL32) value -= at + hole.offset;
+        std::memcpy(code + at + hole.offset, &value, 4);
+    }
+}
+
+uint32_t reg_offset(int x) {
+    return offsetof(JitState, registers) + 4 * x;
+}
+
+uint8_t *compile(
+    const TraceOp *ops, uint32_t nops, bool loops, reg_t next, size_t *size
+) {
+    // One per op, and the exit stencil when it's needed
+    const Stencil **chosen = (const Stencil **)std::malloc(
+        (nops + 1) * sizeof(Stencil *)
+    );
+    size_t *offsets = (size_t *)std::malloc((nops + 2) * sizeof(size_t));
+
+    uint32_t n = 0;
+    for(; n < nops; ++n) {
+        chosen[n] = stencils[OPCODE(ops[n].word)];
+        if(n == nops - 1 && !loops && chosen[n] == &STENCIL_PRG) {
+            chosen[n] = &STENCIL_PRG_EXIT;
+        }
+    }
+    if(nops == 0 || OPCODE(ops[nops - 1].word) != OP_PRG) {
+        chosen[n++] = &STENCIL_EXIT;
+    }
+
+    // The last stencil only goes back to the start, if anywhere
+    offsets[0] = 0;
+    for(uint32_t i = 0; i < n; ++i) {
+        offsets[i + 1] = offsets[i] + placed_size(*chosen[i], i + 1 < n);
+    }
+
+    uint8_t *code = (uint8_t *)std::malloc(offsets[n]);
+    for(uint32_t i = 0; i < n; ++i) {
+        uint32_t values[NHOLES] = {};
+        if(i < nops) {
+            reg_t cur = ops[i].word;
+            values[HOLE_A] = reg_offset(
+                OPCODE(cur) == OP_LDI? (cur >> 25) & 7 : RX(2, cur)
+            );
+            values[HOLE_B] = reg_offset(RX(1, cur));
+            values[HOLE_C] = reg_offset(RX(0, cur));
+            values[HOLE_PC] = ops[i].pc;
+            values[HOLE_IMM] = cur & 0x01ffffff;
+            values[HOLE_WORD] = cur;
+            values[HOLE_TARGET] = ops[i].target;
+            values[HOLE_SITE] = ops[i].ic * sizeof(JitIc);
+        }
+        else {
+            values[HOLE_PC] = next;
+        }
+        values[HOLE_NEXT] = i + 1 < n? offsets[i + 1] : 0;
+        place(code, offsets[i], offsets[i + 1] - offsets[i], *chosen[i], values);
+    }
+
+    *size = offsets[n];
+    std::free(chosen);
+    std::free(offsets);
+    return code;
+}
+
+uint8_t *trampoline(size_t *size) {
+    const Stencil &stencil = STENCIL_TRAMPOLINE;
+    uint8_t *code = (uint8_t *)std::malloc(stencil.size);
+    std::memcpy(code, stencil.code, stencil.size);
+    *size = stencil.size;
+    return code;
+}
+
+}
+
+const JitBackend cnp_backend = {compile, trampoline, "cnp"};
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+Regression gate for bench.py results, `make bench-check` runs it against the
+checked-in baseline.
+
+Every engine/workload pair in the baseline is compared on its median time per
+instruction (wall time for anything that didn't report instructions). A pair
+only counts as a regression if it got slower by more than the threshold plus
+the noise of both runs, estimated from their run-to-run spread, so a noisy
+workload needs a bigger slowdown before it's flagged. A pair which used to
+succeed and now fails always counts, and so does one which is missing from
+either side: from the current results although its engine and workload were
+both asked for, or from the baseline, which has to be re-recorded to cover
+it. Pairs left out with --engines or --workloads are just skipped.
+
+Exits 1 if anything regressed or is missing.
+"""
+
+import json
+import math
+import sys
+
+NOISE_SIGMAS = 2.0 # How many combined standard deviations count as noise
+
+def metric(result: dict):
+    """Median time per instruction if known, else median wall time, and cv."""
+    stat = result.get("ns_per_instruction") or result["wall"]
+    return stat["median"], stat["cv"]
+
+def compare(baseline: dict, current: dict, threshold: float):
+    results = {(r["engine"], r["workload"]): r for r in current["results"]}
+    # Results from before bench.py recorded these asked for everything
+    engines = current.get("engines")
+    workloads = current.get("workloads")
+    regressions = 0
+    missing = 0
+    skipped = 0
+
+    for base in baseline["results"]:
+        key = base["engine"], base["workload"]
+        name = f"{key[1]:>14} {key[0]:>5}"
+        if (cur := results.get(key)) is None:
+            if (engines is None or key[0] in engines) and (
+                workloads is None or key[1] in workloads
+            ):
+                print(f"{name}: MISSING from current results")
+                missing += 1
+            else:
+                skipped += 1
+            continue
+
+        if base["status"] != "OK":
+            continue
+        if cur["status"] != "OK":
+            print(f"{name}: REGRESSED, now fails with {cur['status']}")
+            regressions += 1
+            continue
+
+        if base.get("instructions") != cur.get("instructions"):
+            # Not a regression by itself, but the times aren't comparable
+            print(
+                f"{name}: instruction count changed "
+                f"{base.get('instructions')} -> {cur.get('instructions')}"
+            )
+
+        old, old_cv = metric(base)
+        new, new_cv = metric(cur)
+        if old <= 0:
+            continue
+
+        change = new / old - 1
+        noise = NOISE_SIGMAS * math.hypot(old_cv, new_cv)
+        limit = threshold + noise
+        verdict = "ok"
+        if change > limit:
+            verdict = "REGRESSED"
+            regressions += 1
+        elif change < -limit:
+            verdict = "improved"
+
+        print(
+            f"{name}: {change*100:+6.1f}% "
+            f"(limit {limit*100:4.1f}%, noise {noise*100:4.1f}%) {verdict}"
+        )
+
+    known = {(r["engine"], r["workload"]) for r in baseline["results"]}
+    for key in sorted(results.keys() - known):
+        print(f"{key[1]:>14} {key[0]:>5}: MISSING from baseline, re-record it")
+        missing += 1
+
+    return regressions, missing, skipped
+
+def main(*argv):
+    threshold = 0.05
+    args = list(argv[1:])
+    if len(args) >= 2 and args[0] == "--threshold":
+        threshold = float(args[1]) / 100
+        args = args[2:]
+
+    if len(args) != 2:
+        print(f"Usage: python {argv[0]} [--threshold PERCENT] <baseline> <current>")
+        return 2
+
+    with open(args[0]) as f:
+        baseline = json.load(f)
+    with open(args[1]) as f:
+        current = json.load(f)
+
+    regressions, missing, skipped = compare(baseline, current, threshold)
+    if skipped:
+        print(f"{skipped} baseline pair(s) not asked for this time")
+    if regressions:
+        print(f"{regressions} regression(s) beyond {threshold*100:g}% + noise")
+    if missing:
+        print(f"{missing} engine/workload pair(s) missing from one side")
+    return 1 if regressions or missing else 0
+
+if __name__ == "__main__":
+    sys.exit(main(*sys.argv))
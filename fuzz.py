@@ -0,0 +1,730 @@
+#!/usr/bin/env python3
+"""
+Random program fuzzer for the engines in ./um, `make fuzz` runs it.
+
+Programs are generated one instruction at a time against a model of the UM, so
+the generator always knows the machine's state and only emits what it means
+to: loads and stores inside live arrays, divisions by something non-zero,
+characters that fit in a byte. On top of arithmetic and I/O they allocate and
+free arrays (identifiers are kept in a handle array in r7 so they're never
+baked into the code), read their own code out of array 0, patch instructions
+further ahead in array 0 before reaching them, jump with `prg 0`, loop back
+with `prg 0` often enough for the JIT engines to compile the loop, and build a
+new program in an array to `prg` into (those also keep data in array 0 past
+their code, so array 0 ends up bigger than the program file). Unless
+--no-errors is given some end on a well-defined failure instead of `hlt`.
+
+Every engine runs every program with the same random input, and output and
+exit status are compared against `try` (and `try` against the model). Then
+`um --check` compares the final registers, pc and arrays of each engine with
+`try`. The JIT engines run each program with one of JIT_FLAGS, and if either
+never compiles a trace in the whole run that's a failure too, since then
+nothing but their interpreter was tested. Failing programs are kept with
+their input and a disassembly.
+"""
+
+import copy
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+from typing import Optional
+
+from um import MAX_IMM, CODES
+
+ENGINES = ["try", "try4", "trap", "aot", "jit", "cnp", "hw1c", "hw1"]
+JIT_ENGINES = ["jit", "cnp"]
+
+# Picked per program: a code cache small enough to evict all the time, or
+# not. Each size loses traces at different points of the same loop, 2 and 4
+# while others still jump to them. --jit-thread isn't here since these
+# programs are over before the thread has compiled anything.
+JIT_FLAGS = [[], ["--jit-size", "1"], ["--jit-size", "2"], ["--jit-size", "4"]]
+
+# Exit status of um for each error, ERR_* in um.h
+ERRORS = ["OK", "INV", "ARR", "DEL", "DIV", "PRG", "CHR", "EOF"]
+
+HANDLES = 16 # Slots in the handle array r7 points to
+AGAIN = HANDLES # Word after them, whether a loop's been run a second time
+COUNTER = HANDLES + 1 # Then where a loop, and one inside it, keep their counts
+LOOPS = (100, 200) # Times a loop runs, the JIT engines compile after 64
+INNER = (2, 6) # Times a loop inside one runs, each time round
+SCRIBBLE = 1 << 13 # Where loaded programs keep data past their code
+SCRATCH = range(7) # Everything except r7 is fair game
+
+class Fail(Exception):
+    """The model hit an error, args[0] is its name."""
+
+def op(name: str, a=0, b=0, c=0):
+    return CODES[name] << 28 | a << 6 | b << 3 | c
+
+def ldi(a: int, imm: int):
+    return CODES["ldi"] << 28 | a << 25 | imm
+
+class Machine:
+    """
+    Model of the UM. Identifiers are handed out like the engines do (lowest
+    fresh one, freed ones reused last in first out) so even arithmetic on
+    them comes out the same.
+    """
+
+    def __init__(self, input: bytes):
+        self.regs = [0] * 8
+        self.arrays: dict[int, list[int]] = {0: []}
+        self.freed: list[int] = []
+        self.fresh = 1
+        self.input = input
+        self.read = 0
+        self.output = bytearray()
+
+    def execute(self, word: int):
+        """Run anything but prg and hlt, which the generator deals with."""
+        code = word >> 28
+        a, b, c = (word >> 6) & 7, (word >> 3) & 7, word & 7
+        r = self.regs
+        match code:
+            case 0:
+                if r[c]: r[a] = r[b]
+            case 1:
+                array = self.arrays.get(r[b])
+                if array is None or r[c] >= len(array): raise Fail("ARR")
+                r[a] = array[r[c]]
+            case 2:
+                array = self.arrays.get(r[a])
+                if array is None or r[b] >= len(array): raise Fail("ARR")
+                array[r[b]] = r[c]
+            case 3: r[a] = (r[b] + r[c]) & 0xffffffff
+            case 4: r[a] = (r[b] * r[c]) & 0xffffffff
+            case 5:
+                if r[c] == 0: raise Fail("DIV")
+                r[a] = r[b] // r[c]
+            case 6: r[a] = ~(r[b] & r[c]) & 0xffffffff
+            case 8:
+                ident = self.freed.pop() if self.freed else self.fresh
+                if ident == self.fresh: self.fresh += 1
+                self.arrays[ident] = [0] * r[c]
+                r[b] = ident
+            case 9:
+                if r[c] == 0 or r[c] not in self.arrays: raise Fail("DEL")
+                del self.arrays[r[c]]
+                self.freed.append(r[c])
+            case 10:
+                if r[c] > 0xff: raise Fail("CHR")
+                self.output.append(r[c])
+            case 11:
+                if self.read < len(self.input):
+                    r[c] = self.input[self.read]
+                    self.read += 1
+                else:
+                    r[c] = 0xffffffff
+            case 13: r[(word >> 25) & 7] = word & MAX_IMM
+            case _: raise Fail("INV")
+
+    def run(self, pc: int, end: int):
+        """Run array 0 from pc until it jumps to end, prg 0 being the only
+        way anywhere but the next word."""
+        code = self.arrays[0]
+        while pc != end:
+            word = code[pc]
+            if word >> 28 == CODES["prg"]:
+                assert self.regs[(word >> 3) & 7] == 0, "prg out of a loop"
+                pc = self.regs[word & 7]
+            else:
+                self.execute(word)
+                pc += 1
+
+class Generator:
+    """
+    Emits one program into `static` while running it on `machine`. Patches
+    are words stored into array 0 ahead of the pc, the position runs the
+    patch while the program file has something else there.
+    """
+
+    def __init__(
+        self, rng: random.Random, machine: Machine, depth: int,
+        length: int, errors: bool, slots: dict[int, int], reserved: set[int],
+        capacity: Optional[int] = None
+    ):
+        self.rng = rng
+        self.m = machine
+        self.depth = depth # How many more programs can be loaded with prg
+        self.length = length
+        self.errors = errors
+        self.slots = slots # Handle slot: identifier of a live array
+        self.reserved = reserved # Slots the program can't touch
+        self.capacity = capacity # Size of array 0 if it's more than the code
+        self.static: list[int] = []
+        self.patches: dict[int, int] = {}
+        self.ended: Optional[str] = None # Error name or "OK"
+        self.chars: list[int] = [] # Where string() put its ldis
+        self.nest = 0 # Loops the generator is inside
+
+    def pos(self):
+        return len(self.static)
+
+    def emit(self, word: int, run=True):
+        """Append word, running it (or whatever was patched in) if run."""
+        pos = self.pos()
+        self.static.append(word)
+        word = self.patches.pop(pos, word)
+        code = self.m.arrays[0]
+        if pos < len(code):
+            code[pos] = word
+        else:
+            code.append(word)
+        if run:
+            self.m.execute(word)
+
+    def reg(self, *avoid: int):
+        return self.rng.choice([r for r in SCRATCH if r not in avoid])
+
+    def value(self):
+        return self.rng.choice([
+            0, 1, 2, 0xff, MAX_IMM, self.rng.randrange(256),
+            self.rng.randrange(MAX_IMM + 1)
+        ])
+
+    def const(self, r: int, value: int, tmp: int, run=True):
+        """Load any 32-bit value into r, clobbering tmp."""
+        if value <= MAX_IMM:
+            self.emit(ldi(r, value), run)
+            return
+        self.emit(ldi(r, value >> 16), run)
+        self.emit(ldi(tmp, 1 << 16), run)
+        self.emit(op("mul", r, r, tmp), run)
+        self.emit(ldi(tmp, value & 0xffff), run)
+        self.emit(op("add", r, r, tmp), run)
+
+    def usable(self):
+        return [s for s in self.slots if s not in self.reserved]
+
+    def load_handle(self, r: int, slot: int):
+        self.emit(ldi(r, slot))
+        self.emit(op("lda", r, 7, r))
+
+    # Snippets, each at most MAX_SNIPPET words except loop and transfer
+
+    def arith(self):
+        name = self.rng.choice(["add", "mul", "div", "nan", "mov"])
+        a, b, c = self.reg(), self.rng.randrange(8), self.rng.randrange(8)
+        if name == "div" and self.m.regs[c] == 0:
+            self.emit(ldi(c := self.reg(), self.rng.randrange(1, 100)))
+        self.emit(op(name, a, b, c))
+
+    def idiom(self):
+        """What compilers build NOT, AND, OR and subtraction out of, with the
+        registers overlapping sometimes."""
+        t = self.reg()
+        u = self.reg(t) if self.rng.random() < 0.8 else t
+        x, y, dst = self.rng.randrange(8), self.rng.randrange(8), self.reg()
+        kind = self.rng.choice(["not", "and", "or", "sub"])
+        if kind == "not":
+            self.emit(op("nan", t, x, x))
+        elif kind == "and":
+            self.emit(op("nan", t, x, y))
+            self.emit(op("nan", dst, t, t))
+        elif kind == "or":
+            self.emit(op("nan", t, x, x))
+            self.emit(op("nan", u, y, y))
+            self.emit(op("nan", dst, *self.rng.sample([t, u], 2)))
+        else:
+            if self.rng.random() < 0.5:
+                self.emit(ldi(u, 1))
+            self.emit(op("nan", t, y, y))
+            self.emit(op("add", t, *self.rng.sample([t, u], 2)))
+            self.emit(op("add", dst, *self.rng.sample([t, x], 2)))
+
+    def load_imm(self):
+        self.emit(ldi(self.reg(), self.value()))
+
+    def new(self):
+        free = [s for s in range(HANDLES) if s not in self.slots]
+        if not free: return self.delete()
+        slot = self.rng.choice(free)
+        size = self.rng.choice([0, 1, 2, 7, 64, self.rng.randrange(300)])
+        a = self.reg()
+        b = self.reg(a)
+        self.emit(ldi(a, size))
+        self.emit(op("new", 0, b, a))
+        self.emit(ldi(a, slot))
+        self.emit(op("sta", 7, a, b))
+        self.slots[slot] = self.m.regs[b]
+
+    def delete(self):
+        if not (usable := self.usable()): return self.new()
+        slot = self.rng.choice(usable)
+        r = self.reg()
+        self.load_handle(r, slot)
+        self.emit(op("del", 0, 0, r))
+        del self.slots[slot]
+
+    def access(self):
+        usable = [s for s in self.usable() if self.m.arrays[self.slots[s]]]
+        if not usable: return self.new()
+        slot = self.rng.choice(usable)
+        size = len(self.m.arrays[self.slots[slot]])
+        h = self.reg()
+        i = self.reg(h)
+        self.load_handle(h, slot)
+        self.emit(ldi(i, self.rng.randrange(size)))
+        if self.rng.random() < 0.5:
+            self.emit(op("lda", self.reg(h, i), h, i))
+        else:
+            self.emit(op("sta", h, i, self.rng.randrange(8)))
+
+    def read_code(self):
+        """Load a word of code already run out of array 0."""
+        if self.pos() == 0: return self.load_imm()
+        z = self.reg()
+        i = self.reg(z)
+        self.emit(ldi(z, 0))
+        self.emit(ldi(i, self.rng.randrange(self.pos())))
+        self.emit(op("lda", self.reg(), z, i))
+
+    def output(self):
+        r = self.reg()
+        if self.m.regs[r] > 0xff or self.rng.random() < 0.5:
+            self.emit(ldi(r, self.rng.randrange(32, 127)))
+        self.emit(op("out", 0, 0, r))
+
+    def string(self):
+        """How strings get printed, an ldi and an out per character, in one
+        register or a few."""
+        regs = self.rng.sample(SCRATCH, self.rng.randint(1, 3))
+        for _ in range(self.rng.randint(2, self.MAX_SNIPPET // 2)):
+            r = self.rng.choice(regs)
+            self.chars.append(self.pos())
+            self.emit(ldi(r, self.rng.randrange(32, 127)))
+            self.emit(op("out", 0, 0, r))
+
+    def input(self):
+        self.emit(op("inp", 0, 0, self.reg()))
+
+    def patch(self):
+        """Overwrite an instruction a little further on before it runs."""
+        z = self.reg()
+        i = self.reg(z)
+        v = self.reg(z, i)
+        t = self.reg(z, i, v)
+        target = self.pos() + 9 + self.rng.randrange(20)
+        if self.rng.random() < 0.5:
+            word = ldi(self.reg(), self.value())
+        else:
+            word = op(self.rng.choice(["add", "mul", "nan"]),
+                self.reg(), self.rng.randrange(8), self.rng.randrange(8))
+        self.emit(ldi(z, 0))
+        self.emit(ldi(i, target))
+        self.const(v, word, t)
+        # Still in the future, so the model can't store it yet
+        self.emit(op("sta", z, i, v), run=False)
+        self.patches[target] = word
+
+    def scribble(self):
+        """Store to or load from array 0 well past the code."""
+        if len(self.m.arrays[0]) <= SCRIBBLE: return self.read_code()
+        z = self.reg()
+        i = self.reg(z)
+        t = self.reg(z, i)
+        self.emit(ldi(z, 0))
+        self.emit(ldi(i, SCRIBBLE + self.rng.randrange(64)))
+        if self.rng.random() < 0.5:
+            self.emit(op("lda", t, z, i))
+        else:
+            self.emit(op("sta", z, i, self.rng.randrange(8)))
+
+    def jump(self):
+        """Jump over some garbage with prg 0."""
+        z = self.reg()
+        p = self.reg(z)
+        skip = self.rng.randrange(1, 4)
+        self.emit(ldi(z, 0))
+        self.emit(ldi(p, self.pos() + 2 + skip))
+        self.emit(op("prg", 0, z, p), run=False)
+        for _ in range(skip):
+            self.emit(self.rng.choice([0xe0000000, 0xf0000000, ldi(0, 0)]), run=False)
+
+    def body(self):
+        """Snippets that run the same way every time round a loop: no arrays
+        come or go, nothing's read or patched."""
+        snippets = [
+            (self.arith, 16), (self.idiom, 16), (self.load_imm, 6),
+            (self.access, 10), (self.read_code, 2), (self.output, 4),
+            (self.string, 4), (self.jump, 3), (self.scribble, 2),
+        ]
+        if self.nest == 1:
+            snippets.append((self.inner, 3))
+        snippet = self.rng.choices(*zip(*snippets))[0]
+        if snippet == self.access and not any(
+            self.m.arrays[self.slots[s]] for s in self.usable()
+        ):
+            snippet = self.arith # Instead of the new access falls back on
+        snippet()
+
+    def inner(self):
+        """A loop inside a loop. The outer one's trace runs into this one's,
+        which is how traces end up jumping to each other."""
+        self.loop(INNER)
+
+    def loop(self, runs=LOOPS):
+        """
+        Run a few snippets a number of times drawn from runs, with a counted
+        prg 0 back to the top, so the JIT engines compile them. The body is
+        generated running once, then the model runs the rest. If that fails,
+        a divisor or character that changed on the way round, the loop's
+        generated again. Loops that print a string sometimes store a
+        different character over one of its ldis once they're done and run
+        the whole thing again, which has to throw out the compiled string.
+        """
+        start = self.pos()
+        saved = copy.deepcopy(self.m)
+        chars = len(self.chars)
+        counter = COUNTER + self.nest
+        for _ in range(10):
+            a, b, c, d, v = self.rng.sample(SCRATCH, 5)
+            del self.chars[chars:]
+            self.emit(ldi(a, counter))
+            self.emit(ldi(b, self.rng.randrange(*runs)))
+            self.emit(op("sta", 7, a, b))
+            top = self.pos()
+            self.nest += 1
+            for _ in range(self.rng.randint(2, 8)):
+                self.body()
+            self.nest -= 1
+
+            # Count down in the handle array, then back to the top unless
+            # that got to 0
+            tail = self.pos()
+            end = tail + 11
+            for word in [
+                ldi(a, counter), op("lda", b, 7, a), ldi(c, 0),
+                op("nan", c, c, c), op("add", b, b, c), op("sta", 7, a, b),
+                ldi(a, end), ldi(c, top), op("mov", a, c, b), ldi(c, 0),
+                op("prg", 0, c, a),
+            ]:
+                self.emit(word, run=False)
+            if self.chars[chars:] and not self.nest and self.rng.random() < 0.5:
+                end = self.again(start, self.chars[chars:], a, b, c, d, v)
+            try:
+                self.m.run(tail, end)
+                return
+            except Fail:
+                del self.static[start:]
+                self.m.__dict__ = copy.deepcopy(saved).__dict__
+        self.arith()
+
+    def again(
+        self, start: int, chars: list[int], a: int, b: int, c: int, d: int,
+        v: int
+    ):
+        """After a loop, the first time only, change one of the characters
+        at chars and go back to start. Returns where it carries on."""
+        at = self.rng.choice(chars)
+        word = ldi((self.static[at] >> 25) & 7, self.rng.randrange(32, 127))
+        patch = self.pos() + 7
+        after = patch + 6 + (1 if word <= MAX_IMM else 5)
+        for w in [
+            ldi(a, AGAIN), op("lda", b, 7, a), ldi(c, patch), ldi(d, after),
+            op("mov", c, d, b), ldi(d, 0), op("prg", 0, d, c),
+            ldi(b, 1), op("sta", 7, a, b), ldi(c, at),
+        ]:
+            self.emit(w, run=False)
+        self.const(v, word, b, run=False)
+        for w in [
+            op("sta", d, c, v), ldi(c, start), op("prg", 0, d, c),
+            ldi(b, 0), op("sta", 7, a, b),
+        ]:
+            self.emit(w, run=False)
+        assert self.pos() == after + 2
+        return self.pos()
+
+    def transfer(self):
+        """
+        Build a whole new program in a fresh array and prg into it. It's
+        generated first on a copy of the machine as it'll be after the prg,
+        and it can't touch its own array since that's being written.
+        """
+        free = [s for s in range(HANDLES) if s not in self.slots]
+        if not free: return self.delete()
+        slot = self.rng.choice(free)
+        entry = self.rng.randrange(4)
+        size = SCRIBBLE + 64 + self.rng.randrange(8)
+
+        # The size isn't known until the program's generated, nothing looks
+        # at it before then so it's filled in after
+        sizing = self.pos()
+        self.emit(ldi(0, 0))
+        self.emit(op("new", 0, 6, 0))
+        self.emit(ldi(0, slot))
+        self.emit(op("sta", 7, 0, 6))
+        ident = self.slots[slot] = self.m.regs[6]
+
+        after = copy.deepcopy(self.m)
+        after.regs[3], after.regs[4], after.regs[5] = 0, 0, entry
+        after.arrays[0] = [0] * (SCRIBBLE + 64)
+        sub = Generator(
+            self.rng, after, self.depth - 1,
+            self.rng.randrange(20, max(21, self.length // 2)), self.errors,
+            dict(self.slots), self.reserved | {slot}, size
+        )
+        for _ in range(entry):
+            sub.emit(self.rng.randrange(1 << 32), run=False)
+        sub.run()
+        assert len(sub.static) <= SCRIBBLE, "loaded program too long"
+
+        self.static[sizing] = self.m.arrays[0][sizing] = ldi(0, size)
+        self.m.arrays[ident] = [0] * size
+        code = sub.static + [0] * (size - len(sub.static))
+        after.arrays[ident] = list(code)
+        after.arrays[0] += [0] * (size - len(after.arrays[0]))
+
+        for i, word in enumerate(code):
+            if word == 0: continue
+            self.const(3, word, 5)
+            self.emit(ldi(4, i))
+            self.emit(op("sta", 6, 4, 3))
+        self.emit(ldi(3, 0))
+        self.emit(ldi(4, 0))
+        self.emit(ldi(5, entry))
+        self.emit(op("prg", 0, 6, 5), run=False)
+
+        # Nothing after this runs, the copy is what the program ends as
+        self.m.__dict__ = after.__dict__
+        self.ended = sub.ended
+
+    MAX_SNIPPET = 16
+
+    def step(self):
+        snippets = [
+            (self.arith, 20), (self.idiom, 4), (self.load_imm, 8), (self.new, 6),
+            (self.delete, 3), (self.access, 15), (self.read_code, 3),
+            (self.output, 6), (self.string, 2), (self.input, 2), (self.patch, 3),
+            (self.jump, 3), (self.scribble, 2), (self.loop, 4),
+        ]
+        if self.patches:
+            snippets.pop() # Patches could land in the loop
+        elif self.depth:
+            snippets.append((self.transfer, 1))
+        snippet = self.rng.choices(*zip(*snippets))[0]
+
+        # Patched positions can't land inside a snippet since its registers
+        # would be clobbered, so those run on their own
+        pending = [p for p in self.patches if p < self.pos() + self.MAX_SNIPPET]
+        if pending and snippet != self.transfer:
+            while self.pos() < min(pending):
+                self.load_imm()
+            self.emit(self.rng.choice([0xe0000000, ldi(0, 0), op("nan", 0, 0, 0)]))
+            return
+        snippet()
+
+    def error(self):
+        """End on a failure every engine is required to detect."""
+        r = self.reg()
+        s = self.reg(r)
+        kind = self.rng.choice(["INV", "ARR", "DEL", "DIV", "CHR", "EOF"])
+        match kind:
+            case "INV":
+                self.emit(self.rng.choice([0xe0000000, 0xffffffff]), run=False)
+            case "ARR":
+                usable = [s for s in self.usable()]
+                if usable and self.rng.random() < 0.7:
+                    slot = self.rng.choice(usable)
+                    self.load_handle(r, slot)
+                    self.const(s, len(self.m.arrays[self.slots[slot]])
+                        + self.rng.randrange(3), self.reg(r, s))
+                else:
+                    self.const(r, self.rng.choice([1 << 20, 0x7fffffff]), s)
+                    self.emit(ldi(s, 0))
+                self.emit(op("lda", 0, r, s), run=False)
+            case "DEL":
+                self.emit(ldi(r, 0))
+                self.emit(op("del", 0, 0, r), run=False)
+            case "DIV":
+                self.emit(ldi(r, 0))
+                self.emit(op("div", s, s, r), run=False)
+            case "CHR":
+                self.emit(ldi(r, 256 + self.rng.randrange(1000)))
+                self.emit(op("out", 0, 0, r), run=False)
+            case "EOF" if self.capacity is None:
+                pass # Just run off the end
+            case "EOF":
+                # There's data past the code, so jump past that
+                self.emit(ldi(r, 0))
+                self.const(s, self.capacity + self.rng.randrange(3), self.reg(r, s))
+                self.emit(op("prg", 0, r, s), run=False)
+        self.ended = kind
+
+    def run(self):
+        """Generate until the length is used up, then halt or fail."""
+        try:
+            while self.pos() < self.length and self.ended is None:
+                self.step()
+            if self.ended is not None:
+                return # A prg took over
+
+            # Stores ahead have to land inside the program
+            while self.patches:
+                self.step()
+            if self.errors and self.rng.random() < 0.3:
+                self.error()
+            else:
+                self.emit(op("hlt"), run=False)
+                self.ended = "OK"
+        except Fail as e:
+            raise AssertionError(f"generated a failing instruction ({e.args[0]})")
+
+def generate(rng: random.Random, length: int, errors: bool):
+    """Returns the program, its input and the model's output and result."""
+    input = bytes(rng.randrange(256) for _ in range(rng.randrange(16)))
+    machine = Machine(input)
+    gen = Generator(rng, machine, 2, length, errors, {}, set())
+    gen.emit(ldi(0, COUNTER + 2))
+    gen.emit(op("new", 0, 7, 0))
+    gen.run()
+    return gen.static, input, bytes(gen.m.output), gen.ended
+
+def run(um: str, argv: list[str], timeout: float):
+    try:
+        proc = subprocess.run(
+            [um, *argv], stdin=subprocess.DEVNULL, capture_output=True,
+            timeout=timeout
+        )
+    except subprocess.TimeoutExpired:
+        return None, "TIMEOUT", ""
+    code = proc.returncode
+    status = ERRORS[code] if 0 <= code < len(ERRORS) else f"exit {code}"
+    return proc.stdout, status, proc.stderr.decode(errors="replace")
+
+def fuzz_one(
+    um: str, engines: list[str], seed: int, length: int, errors: bool,
+    tmp: str, timeout: float
+):
+    """
+    Returns a list of problems with one program, empty if all agree, and the
+    JIT engines that compiled a trace running it.
+    """
+    rng = random.Random(seed)
+    code, input, output, result = generate(rng, length, errors)
+    jit_flags = rng.choice(JIT_FLAGS)
+
+    program = os.path.join(tmp, "fuzz.um")
+    script = os.path.join(tmp, "fuzz.txt")
+    with open(program, "wb") as f:
+        for word in code:
+            f.write(word.to_bytes(4, "big"))
+    with open(script, "wb") as f:
+        f.write(input)
+
+    problems = []
+    compiled = set()
+    ref_out, ref_status, _ = run(um, ["--input", script, program], timeout)
+    if (ref_out, ref_status) != (output, result):
+        problems.append(f"try: {ref_status} but the model expected {result}")
+
+    for engine in engines:
+        if engine == "try": continue
+        flags = ["--input", script, program]
+        name = engine
+        if engine in JIT_ENGINES:
+            flags = jit_flags + flags
+            name = " ".join([engine, *jit_flags])
+        out, status, stats = run(
+            um, [f"--engine={engine}", "--stats", *flags], timeout
+        )
+        if status != ref_status:
+            problems.append(f"{name}: {status}, try: {ref_status}")
+        elif out != ref_out:
+            problems.append(f"{name}: output differs from try")
+        else:
+            _, status, report = run(um, [f"--check={engine}", *flags], timeout)
+            if status != "OK":
+                problems.append(f"{name}: final state differs from try\n{report}")
+        if re.search(r"cache: [1-9]\d* traces", stats):
+            compiled.add(engine)
+
+    return problems, code, input, compiled
+
+def keep(dir: str, seed: int, tmp: str, problems: list[str]):
+    os.makedirs(dir, exist_ok=True)
+    base = os.path.join(dir, f"fuzz-{seed}")
+    shutil.copy(os.path.join(tmp, "fuzz.um"), base + ".um")
+    shutil.copy(os.path.join(tmp, "fuzz.txt"), base + ".txt")
+    with open(base + ".uma", "w") as f:
+        subprocess.run(
+            [sys.executable, "um.py", "dis", base + ".um"], stdout=f, check=False
+        )
+    with open(base + ".log", "w") as f:
+        f.write("\n".join(problems) + "\n")
+    return base
+
+def main(*argv):
+    um = "./um"
+    runs = 100
+    seed = None
+    length = 300
+    errors = True
+    engines = ENGINES
+    out = "build/fuzz"
+    timeout = 10.0
+
+    args = list(argv[1:])
+    while args:
+        match args.pop(0):
+            case "--um": um = args.pop(0)
+            case "--runs": runs = int(args.pop(0))
+            case "--seed": seed = int(args.pop(0))
+            case "--length": length = int(args.pop(0))
+            case "--no-errors": errors = False
+            case "--out": out = args.pop(0)
+            case "--timeout": timeout = float(args.pop(0))
+            case "--engines":
+                if (arg := args.pop(0)) != "all":
+                    engines = arg.split(",")
+            case _:
+                print(f"Usage: python {argv[0]} [--um PATH] [--runs N] [--seed N]")
+                print("    [--length WORDS] [--no-errors] [--out DIR] [--timeout SECONDS]")
+                print("    [--engines A,B,...|all]")
+                return 1
+
+    if seed is None:
+        seed = random.randrange(1 << 32)
+    print(f"Seeds {seed} to {seed + runs - 1}", file=sys.stderr)
+
+    failed: dict[str, int] = {}
+    compiled = {engine: 0 for engine in engines if engine in JIT_ENGINES}
+    with tempfile.TemporaryDirectory() as tmp:
+        for n in range(seed, seed + runs):
+            problems, code, _, traced = fuzz_one(
+                um, engines, n, length, errors, tmp, timeout
+            )
+            for engine in traced:
+                compiled[engine] += 1
+            if not problems:
+                continue
+            base = keep(out, n, tmp, problems)
+            print(f"seed {n} ({len(code)} words) kept as {base}.um:", file=sys.stderr)
+            for problem in problems:
+                print(f"  {problem.splitlines()[0]}", file=sys.stderr)
+                engine = problem.split(":", 1)[0].split()[0]
+                failed[engine] = failed.get(engine, 0) + 1
+
+    for engine, count in compiled.items():
+        print(
+            f"{engine}: compiled traces in {count} of {runs} programs",
+            file=sys.stderr
+        )
+    untested = [engine for engine, count in compiled.items() if not count]
+
+    if not failed and not untested:
+        print(f"All {runs} programs agree", file=sys.stderr)
+        return 0
+    for engine, count in failed.items():
+        print(f"{engine}: {count} of {runs} programs differ", file=sys.stderr)
+    for engine in untested:
+        print(f"{engine}: only its interpreter ran", file=sys.stderr)
+    return 1
+
+if __name__ == "__main__":
+    sys.exit(main(*sys.argv))
@@ -17,12 +17,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+
 //#define USE_COMPUTED 1
 
-// XXXX .... .... .... .... ...A AABB BCCC (generic)
-// 1101 III. NNNN NNNN NNNN NNNN NNNN NNNN (ldi)
-#define OPCODE(n) ((n) >> 28)
-#define RX(n, x) (((x) >> ((n)*3)) & 0x7)
 #define RI(x) (((x) >> 25) & 0x7)
 #define RA(x) (RX(2, x))
 #define RB(x) (RX(1, x))
@@ -34,38 +35,6 @@
 #define REG_C() REG(RC(cur))
 #define IMM() (cur & 0x01ffffff) // Immediate value, 25 bits
 
-#define OP_MOV   0 // A <- B unless C = 0
-#define OP_LDA   1 // A <- B[C]
-#define OP_STA   2 // A[B] <- C
-#define OP_ADD   3 // A <- B + C mod 2^32
-#define OP_MUL   4 // A <- B * C mod 2^32
-#define OP_DIV   5 // A <- int(B / C)
-#define OP_NAN  6 // A <- ~(B & C)
-#define OP_HLT   7 // halt execution
-#define OP_NEW   8 // B <- new reg_t[C]
-#define OP_DEL   9 // delete C
-#define OP_OUT  10 // putc(C)
-#define OP_INP  11 // C <- getc(), -1 EOF
-#define OP_PRG  12 // prog <- copy(B); PC <- C
-#define OP_LDI  13 // A <- N
-
-#define OP_INVALID 14
-#define OP_x14  14
-#define OP_x15  15 // Defined for completion's sake
-
-typedef enum {
-    ERR_OK = 0,
-    ERR_INV, // Invalid instruction
-    ERR_ARR, // Inactive array identifier
-    ERR_DEL, // Deleted 0 or inactive array
-    ERR_DIV, // Division by zero
-    ERR_PRG, // Loaded program from inactive array
-    ERR_CHR, // Printed character outside of [0, 255]
-    ERR_EOF  // PC out of bounds
-} Error;
-
-typedef uint32_t reg_t;
-
 typedef struct {
     reg_t size;
     void *data;
@@ -78,7 +47,7 @@ typedef struct {
 
 #define INDEX(type, arr, index) ((type *)((arr).data))[index]
 
-void link_freelist(Freelist *free, reg_t i, reg_t last) {
+static void link_freelist(Freelist *free, reg_t i, reg_t last) {
     for(; i < last; ++i) {
         free[i].next = i + 1;
         free[i].data = NULL; // Inactive array
@@ -95,17 +64,11 @@ typedef struct {
     reg_t registers[8];
 } VM;
 
-const char *errname(Error err) {
-    switch(err) {
-        case ERR_OK: return "OK";
-        case ERR_INV: return "Invalid instruction";
-        case ERR_ARR: return "Inactive array identifier";
-        case ERR_DEL: return "Deleted 0 or inactive array";
-        case ERR_DIV: return "Division by zero";
-        case ERR_PRG: return "Loaded program from inactive array";
-        case ERR_CHR: return "Printed character outside of [0, 255]";
-        case ERR_EOF: return "PC out of bounds";
-        default: return "Unknown error";
+static void check_arrays(void *ctx) {
+    VM *vm = ctx;
+    for(reg_t i = 0; i < vm->arrays.size; ++i) {
+        Array array = INDEX(Array, vm->arrays, i);
+        if(array.data) check_array(i, array.data, array.size);
     }
 }
 
@@ -127,6 +90,7 @@ const char *errname(Error err) {
     #define DISPATCH_GOTO() do { \
         if(vm.pc >= vm.prog.size) FAIL(ERR_EOF); \
         cur = INDEX(reg_t, vm.prog, vm.pc++); \
+        ++steps; \
         SWITCH(cur); \
     } while(0)
     #define TARGET(op) TARGET_ ## op
@@ -140,10 +104,13 @@ const char *errname(Error err) {
 #define FAIL(err) do { error = err; goto finish; } while(0)
 
 /**
- * Pass VM by value to avoid indirection overhead. Return for debug.
+ * Work on a local copy of the VM to avoid indirection overhead, it's only
+ * written back at the end so the caller can tear it down. Return for debug.
 **/
-Error interpret(VM vm) {
+static Error interpret(VM *state, uint64_t *steps_out) {
+    VM vm = *state;
     Error error = ERR_OK;
+    uint64_t steps = 0;
     DISPATCH_TABLE(
         &&TARGET(OP_MOV),
         &&TARGET(OP_LDA), &&TARGET(OP_STA),
@@ -157,6 +124,7 @@ Error interpret(VM vm) {
 
     do {
         reg_t cur = INDEX(reg_t, vm.prog, vm.pc++);
+        ++steps;
         //printop(cur);
         //printregs(&vm);
         SWITCH(cur) {
@@ -263,17 +231,18 @@ Error interpret(VM vm) {
             TARGET(OP_OUT): {
                 reg_t c = REG_C();
                 if(c > 0xff) FAIL(ERR_CHR); // Invalid character
-                putchar(c);
+                output_putc(c);
                 DISPATCH_GOTO();
             }
 
             TARGET(OP_INP): {
-                int c = getchar();
-                REG_C() = (c == EOF? -1 : c);
+                REG_C() = input_getc(steps); // -1 on EOF
                 DISPATCH_GOTO();
             }
 
             TARGET(OP_PRG): {
+                PERF_CHECK(steps);
+                CHECK_POINT(steps, vm.pc, cur, vm.registers, check_arrays, &vm);
                 // It's not explicitly stated but PRG 0 is a no-op aside from
                 // assigning the PC, so it's likely intended to double as an
                 // absolute jump.
@@ -319,42 +288,19 @@ Error interpret(VM vm) {
     FAIL(ERR_EOF);
 
     finish:
+        CHECK_DONE(steps, error, vm.pc, vm.registers, check_arrays, &vm);
+        *state = vm;
+        *steps_out = steps;
         return error;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc < 2) {
-        fprintf(stderr, "Usage: %s <program>\n", argv[0]);
-        return 0;
-    }
-
-    FILE *fp = fopen(argv[1], "rb");
-    if(!fp) {
-        perror("Failed to open program file");
-        return -1;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    reg_t *data = (reg_t *)malloc(size);
-
-    for(size_t i = 0; i < size / sizeof(reg_t); ++i) {
-        uint8_t buf[4];
-        if(fread(buf, 1, 4, fp) < 4) {
-            break;
-        }
-
-        data[i] = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
-    }
-
-    fclose(fp);
-
+Error hw1c_run(const reg_t *code, reg_t size, uint64_t *steps) {
     Array prog = {
-        .size = (reg_t)(size / sizeof(reg_t)),
-        .data = data
+        .size = size,
+        .data = malloc(size * sizeof(reg_t))
     };
+    memcpy(prog.data, code, size * sizeof(reg_t));
+
     Array arrays = {
         .size = 256,
         .data = calloc(256, sizeof(Array))
@@ -370,9 +316,14 @@ int main(int argc, char *argv[]) {
         .pc = 0,
         .registers = {0}
     };
-    Error err = interpret(vm);
-    if(err) {
-        fprintf(stderr, "%s\n", errname(err));
+    perf_phase(PERF_EXEC);
+    Error err = interpret(&vm, steps);
+    perf_phase(PERF_TEARDOWN);
+
+    // Inactive arrays have NULL data so this frees exactly the active ones
+    for(reg_t i = 0; i < vm.arrays.size; ++i) {
+        free(INDEX(Array, vm.arrays, i).data);
     }
+    free(vm.arrays.data);
     return err;
 }
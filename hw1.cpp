@@ -17,12 +17,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+
 //#define USE_COMPUTED 1
 
-// XXXX .... .... .... .... ...A AABB BCCC (generic)
-// 1101 III. NNNN NNNN NNNN NNNN NNNN NNNN (ldi)
-#define OPCODE(n) ((n) >> 28)
-#define RX(n, x) (((x) >> ((n)*3)) & 0x7)
 #define RI(x) (((x) >> 25) & 0x7)
 #define RA(x) (RX(2, x))
 #define RB(x) (RX(1, x))
@@ -34,37 +35,7 @@
 #define REG_C() REG(RC(cur))
 #define IMM() (cur & 0x01ffffff) // Immediate value, 25 bits
 
-#define OP_MOV   0 // A <- B unless C = 0
-#define OP_LDA   1 // A <- B[C]
-#define OP_STA   2 // A[B] <- C
-#define OP_ADD   3 // A <- B + C mod 2^32
-#define OP_MUL   4 // A <- B * C mod 2^32
-#define OP_DIV   5 // A <- int(B / C)
-#define OP_NAN  6 // A <- ~(B & C)
-#define OP_HLT   7 // halt execution
-#define OP_NEW   8 // B <- new reg_t[C]
-#define OP_DEL   9 // delete C
-#define OP_OUT  10 // putc(C)
-#define OP_INP  11 // C <- getc(), -1 EOF
-#define OP_PRG  12 // prog <- copy(B); PC <- C
-#define OP_LDI  13 // A <- N
-
-#define OP_INVALID 14
-#define OP_x14  14
-#define OP_x15  15 // Defined for completion's sake
-
-enum Error {
-    ERR_OK = 0,
-    ERR_INV, // Invalid instruction
-    ERR_ARR, // Inactive array identifier
-    ERR_DEL, // Deleted 0 or inactive array
-    ERR_DIV, // Division by zero
-    ERR_PRG, // Loaded program from inactive array
-    ERR_CHR, // Printed character outside of [0, 255]
-    ERR_EOF  // PC out of bounds
-};
-
-typedef uint32_t reg_t;
+namespace {
 
 template<typename T>
 struct Array {
@@ -225,6 +196,30 @@ struct VM {
 };
 //*/
 
+/**
+ * is_active isn't reliable for deleted arrays (it's whatever their offset
+ * was), so which identifiers are free comes from walking the free list. The
+ * bounds are checked for the same reason, a range outside the used memory is
+ * reported without its contents.
+**/
+void check_arrays(void *ctx) {
+    VM &vm = *(VM *)ctx;
+    bool *inactive = (bool *)calloc(vm.index.size, sizeof(bool));
+    for(reg_t i = vm.free; i && i < vm.index.size && !inactive[i]; i = vm.get_next(i)) {
+        inactive[i] = true;
+    }
+
+    reg_t used = vm.memory.size - vm.unused;
+    check_array(0, vm.memory.data, vm.progsize);
+    for(reg_t i = 1; i < vm.index.size; ++i) {
+        if(inactive[i]) continue;
+        ArrayDef array = vm.index[i];
+        bool inside = array.offset <= used && array.size <= used - array.offset;
+        check_array(i, inside? &vm.memory[array.offset] : nullptr, array.size);
+    }
+    free(inactive);
+}
+
 /*
 typedef struct {
     reg_t free;
@@ -258,20 +253,6 @@ const char *opname(reg_t code) {
     }
 }
 
-const char *errname(Error err) {
-    switch(err) {
-        case ERR_OK: return "OK";
-        case ERR_INV: return "INV";
-        case ERR_ARR: return "ARR";
-        case ERR_DEL: return "DEL";
-        case ERR_DIV: return "DIV";
-        case ERR_PRG: return "PRG";
-        case ERR_CHR: return "CHR";
-        case ERR_EOF: return "EOF";
-        default: return "Unknown error";
-    }
-}
-
 /**
  * Saw this trick in the CPython interpreter years ago, seems to be more
  *  complicated now but a simpler version can be found at
@@ -290,6 +271,7 @@ const char *errname(Error err) {
     #define DISPATCH_GOTO() do { \
         if(vm.pc >= vm.progsize) FAIL(ERR_EOF); \
         cur = vm.memory[vm.pc++]; \
+        ++steps; \
         SWITCH(cur) {} \
     } while(0)
     #define TARGET(op) TARGET_ ## op
@@ -303,11 +285,14 @@ const char *errname(Error err) {
 #define FAIL(err) do { error = err; goto finish; } while(0)
 
 /**
- * Pass VM by value to avoid indirection overhead. Return for debug.
+ * Work on a local copy of the VM to avoid indirection overhead, it's only
+ * written back at the end so the caller can tear it down. Return for debug.
 **/
-Error interpret(VM vm) {
+Error interpret(VM &state, uint64_t *steps_out) {
+    VM vm = state;
     //printf("Prog size %u | free %u\n", vm.progsize, vm.free);
     Error error = ERR_OK;
+    uint64_t steps = 0;
     DISPATCH_TABLE(
         &&TARGET(OP_MOV),
         &&TARGET(OP_LDA), &&TARGET(OP_STA),
@@ -321,6 +306,7 @@ Error interpret(VM vm) {
 
     do {
         reg_t cur = vm.memory[vm.pc++];
+        ++steps;
         //printf("%u pc=%u (%u)\n", OPCODE(cur), vm.pc, vm.progsize);
         SWITCH(cur) {
             TARGET(OP_MOV): {
@@ -443,17 +429,18 @@ Error interpret(VM vm) {
             TARGET(OP_OUT): {
                 reg_t c = REG_C();
                 if(c > 0xff) FAIL(ERR_CHR); // Invalid character
-                putchar(c);
+                output_putc(c);
                 DISPATCH_GOTO();
             }
 
             TARGET(OP_INP): {
-                int c = getchar();
-                REG_C() = (c == EOF? -1 : c);
+                REG_C() = input_getc(steps); // -1 on EOF
                 DISPATCH_GOTO();
             }
 
             TARGET(OP_PRG): {
+                PERF_CHECK(steps);
+                CHECK_POINT(steps, vm.pc, cur, vm.registers, check_arrays, &vm);
                 // It's not explicitly stated but PRG 0 is a no-op aside from
                 // assigning the PC, so it's likely intended to double as an
                 // absolute jump.
@@ -495,37 +482,17 @@ Error interpret(VM vm) {
     FAIL(ERR_EOF);
 
     finish:
+        CHECK_DONE(steps, error, vm.pc, vm.registers, check_arrays, &vm);
+        state = vm;
+        *steps_out = steps;
         return error;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc < 2) {
-        fprintf(stderr, "Usage: %s <program>\n", argv[0]);
-        return 0;
-    }
-
-    FILE *fp = fopen(argv[1], "rb");
-    if(!fp) {
-        perror("Failed to open program file");
-        return -1;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    reg_t size = ftell(fp) / sizeof(reg_t);
-    fseek(fp, 0, SEEK_SET);
+}
 
+Error hw1_run(const reg_t *code, reg_t size, uint64_t *steps) {
     reg_t *data = (reg_t *)malloc(size * sizeof(reg_t));
-
-    for(reg_t i = 0; i < size; ++i) {
-        uint8_t buf[4];
-        if(fread(buf, 1, 4, fp) < 4) {
-            break;
-        }
-
-        data[i] = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
-    }
-
-    fclose(fp);
+    memcpy(data, code, size * sizeof(reg_t));
 
     Array<ArrayDef> index(256);
     index[0] = {size, 0}; // Program array
@@ -542,9 +509,10 @@ int main(int argc, char *argv[]) {
     };
     vm.set_next(255, 0);
 
-    Error err = interpret(vm);
-    if(err) {
-        fprintf(stderr, "ERR_%s\n", errname(err));
-    }
+    perf_phase(PERF_EXEC);
+    Error err = interpret(vm, steps);
+    perf_phase(PERF_TEARDOWN);
+    free(vm.index.data);
+    free(vm.memory.data);
     return err;
 }
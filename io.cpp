@@ -0,0 +1,428 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cinttypes>
+#include <atomic>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io.h"
+
+#define INPUT_BUFSIZE (64*1024)
+#define OUTPUT_BUFSIZE (64*1024)
+
+// FNV-1a, only needs to catch a replay going off the rails
+#define HASH_INIT 0xcbf29ce484222325ull
+#define HASH_PRIME 0x100000001b3ull
+
+Input input = {nullptr, nullptr};
+Output output = {nullptr, nullptr};
+
+static uint8_t input_buffer[INPUT_BUFSIZE];
+static uint8_t output_buffer[OUTPUT_BUFSIZE];
+
+/**
+ * Where input bytes actually come from. Normally this is handed straight to
+ * `input` but when recording it's kept separate so every byte can be logged.
+**/
+static Input source = {nullptr, nullptr};
+static bool source_scripted = false; // Source is a mapped file, never read()
+static Input script = {nullptr, nullptr}; // Whole mapping, to rewind the source
+
+/**
+ * Recording and replay state. Both hash every byte of output so the replay
+ * can be checked against what was originally printed.
+**/
+struct Event {
+    uint64_t steps; // Instruction count the byte was read at
+    int value; // Byte read, or -1 for EOF
+};
+
+static FILE *record_fp = nullptr;
+static bool replaying = false;
+static Event *replay_events = nullptr;
+static size_t replay_count = 0, replay_next = 0;
+static uint64_t replay_steps, replay_bytes, replay_hash;
+
+static uint64_t output_bytes = 0;
+static uint64_t output_hash = HASH_INIT;
+
+static bool output_hashing() {
+    return record_fp || replaying;
+}
+
+/**
+ * Output goes into a window [output_start, output_limit) of either the flat
+ * buffer (flushed with write() on the interpreter thread) or the ring drained
+ * by the writer thread. output.end is pulled in to output.cur when every byte
+ * has to come through output_spill (terminal line buffering, hashing).
+**/
+static bool output_ready = false;
+static bool output_tty = false; // Line buffered like stdio does for terminals
+static uint8_t *output_start = output_buffer; // First byte not yet committed
+static uint8_t *output_limit = output_buffer;
+
+/**
+ * Single-producer/single-consumer ring for --async-output. The interpreter
+ * only publishes `head` when a window is committed and the writer only
+ * publishes `tail` after each write(), so neither touches the other's cache
+ * line per byte. The interpreter blocks only when the ring is full or when it
+ * needs everything written before reading input.
+**/
+#define RING_SIZE (1024*1024) // Must be a power of two
+#define RING_WINDOW (16*1024) // Most output held back before a commit
+#define RING_CLOSED (1ull << 63) // Set in head once nothing more is coming
+
+static bool ring_wanted = false;
+static uint8_t *ring = nullptr;
+alignas(64) static std::atomic<uint64_t> ring_head{0}; // Bytes committed
+alignas(64) static std::atomic<uint64_t> ring_tail{0}; // Bytes written
+static std::thread ring_writer;
+
+static void write_all(const uint8_t *p, size_t n) {
+    while(n) {
+        ssize_t w = write(STDOUT_FILENO, p, n);
+        if(w < 0) {
+            if(errno == EINTR) continue;
+            break; // Nowhere to report it, same as putchar
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static void ring_drain() {
+    uint64_t tail = ring_tail.load(std::memory_order_relaxed);
+    for(;;) {
+        // Closing sets a bit in head so it also wakes us up
+        uint64_t raw = ring_head.load(std::memory_order_acquire);
+        uint64_t head = raw & ~RING_CLOSED;
+        if(head == tail) {
+            if(raw & RING_CLOSED) break;
+            ring_head.wait(raw, std::memory_order_acquire);
+            continue;
+        }
+
+        // Write as much as is contiguous in one go
+        size_t off = tail & (RING_SIZE - 1);
+        size_t n = head - tail;
+        if(n > RING_SIZE - off) n = RING_SIZE - off;
+        write_all(ring + off, n);
+
+        tail += n;
+        ring_tail.store(tail, std::memory_order_release);
+        ring_tail.notify_one();
+    }
+}
+
+/**
+ * Make the bytes written since the last commit visible to whoever writes them.
+**/
+static void output_commit() {
+    size_t n = output.cur - output_start;
+    if(ring) {
+        if(n) {
+            ring_head.fetch_add(n, std::memory_order_release);
+            ring_head.notify_one();
+        }
+    }
+    else {
+        write_all(output_start, n);
+        output.cur = output_buffer;
+    }
+    output_start = output.cur;
+}
+
+/**
+ * Find space for more output after a commit, blocking if the ring is full.
+**/
+static void output_reserve() {
+    if(ring) {
+        uint64_t head = ring_head.load(std::memory_order_relaxed);
+        uint64_t tail = ring_tail.load(std::memory_order_acquire);
+        while(head - tail == RING_SIZE) {
+            ring_tail.wait(tail, std::memory_order_acquire);
+            tail = ring_tail.load(std::memory_order_acquire);
+        }
+
+        size_t off = head & (RING_SIZE - 1);
+        size_t n = RING_SIZE - (head - tail);
+        if(n > RING_SIZE - off) n = RING_SIZE - off;
+        if(n > RING_WINDOW) n = RING_WINDOW;
+
+        output.cur = output_start = ring + off;
+        output_limit = output.cur + n;
+    }
+    else {
+        output.cur = output_start = output_buffer;
+        output_limit = output_buffer + OUTPUT_BUFSIZE;
+    }
+    output.end = output_tty || output_hashing()? output.cur : output_limit;
+}
+
+/**
+ * Write out everything printed so far, eg before blocking on input.
+**/
+static void output_flush() {
+    if(!output_ready) return;
+
+    output_commit();
+    if(ring) {
+        uint64_t head = ring_head.load(std::memory_order_relaxed);
+        uint64_t tail;
+        while((tail = ring_tail.load(std::memory_order_acquire)) != head) {
+            ring_tail.wait(tail, std::memory_order_acquire);
+        }
+    }
+    output_reserve();
+}
+
+void output_spill(uint8_t c) {
+    if(!output_ready) {
+        output_ready = true;
+        output_tty = isatty(STDOUT_FILENO);
+        output_reserve();
+    }
+    else if(output.cur == output_limit) {
+        output_commit();
+        output_reserve();
+    }
+
+    if(output_hashing()) {
+        output_hash = (output_hash ^ c) * HASH_PRIME;
+        ++output_bytes;
+    }
+
+    *output.cur++ = c;
+    if(output_tty && c == '\n') {
+        output_commit();
+        output_reserve();
+    }
+
+    // Keep the window empty if every byte needs to come through here
+    output.end = output_tty || output_hashing()? output.cur : output_limit;
+}
+
+/**
+ * Refill `in` from the source, returning false on EOF.
+**/
+static bool source_fill(Input *in) {
+    if(source.cur < source.end) {
+        // Hand over whatever the source already has (eg a mapped transcript)
+        *in = source;
+        source.cur = source.end;
+        return true;
+    }
+    if(source_scripted) return false;
+
+    output_flush();
+
+    ssize_t n;
+    do {
+        n = read(STDIN_FILENO, input_buffer, sizeof(input_buffer));
+    } while(n < 0 && errno == EINTR);
+
+    if(n <= 0) return false;
+
+    in->cur = input_buffer;
+    in->end = input_buffer + n;
+    return true;
+}
+
+/**
+ * Write out everything and stop the writer thread, if any.
+**/
+static void output_close() {
+    output_flush();
+    if(ring) {
+        ring_head.fetch_or(RING_CLOSED, std::memory_order_release);
+        ring_head.notify_one();
+        ring_writer.join();
+        std::free(ring);
+        ring = nullptr;
+    }
+}
+
+static void replay_diverged(const char *what, uint64_t steps) {
+    output_close();
+    fprintf(stderr, "Replay diverged at step %" PRIu64 ": %s\n", steps, what);
+    exit(EXIT_FAILURE);
+}
+
+int input_fill(uint64_t steps) {
+    if(replaying) {
+        if(replay_next >= replay_count) {
+            replay_diverged("read past the end of the recording", steps);
+        }
+        Event ev = replay_events[replay_next++];
+        if(ev.steps != steps) {
+            replay_diverged("input read at a different instruction", steps);
+        }
+        return ev.value;
+    }
+
+    if(record_fp) {
+        // `input` stays empty so every byte comes through here
+        static Input recorded = {nullptr, nullptr};
+        int c = -1;
+        if(recorded.cur < recorded.end || source_fill(&recorded)) {
+            c = *recorded.cur++;
+        }
+        fprintf(record_fp, "%" PRIu64 " %d\n", steps, c);
+        return c;
+    }
+
+    if(!source_fill(&input)) return -1;
+    return *input.cur++;
+}
+
+int input_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    source_scripted = true;
+    if(st.st_size == 0) {
+        // mmap rejects empty mappings, and there's nothing to serve anyway
+        close(fd);
+        source.cur = source.end = nullptr;
+        return 0;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return -1;
+
+    // The whole transcript is read front to back exactly once
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    source.cur = (const uint8_t *)data;
+    source.end = source.cur + st.st_size;
+    script = source;
+    return 0;
+}
+
+int io_record(const char *path) {
+    record_fp = fopen(path, "w");
+    if(!record_fp) return -1;
+
+    fprintf(record_fp, "# um recording: <steps> <byte>, then = <steps> <bytes> <hash>\n");
+    return 0;
+}
+
+int io_replay(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if(!fp) return -1;
+
+    size_t capacity = 256;
+    replay_events = (Event *)std::malloc(capacity * sizeof(Event));
+
+    bool finished = false;
+    char line[128];
+    while(fgets(line, sizeof(line), fp)) {
+        if(line[0] == '#') continue;
+
+        if(line[0] == '=') {
+            finished = sscanf(
+                line, "= %" SCNu64 " %" SCNu64 " %" SCNx64,
+                &replay_steps, &replay_bytes, &replay_hash
+            ) == 3;
+            break;
+        }
+
+        Event ev;
+        if(sscanf(line, "%" SCNu64 " %d", &ev.steps, &ev.value) != 2) break;
+
+        if(replay_count == capacity) {
+            capacity *= 2;
+            replay_events = (Event *)std::realloc(
+                replay_events, capacity * sizeof(Event)
+            );
+        }
+        replay_events[replay_count++] = ev;
+    }
+    fclose(fp);
+
+    if(!finished) {
+        // Truncated recording, eg the session was killed before it ended
+        errno = EINVAL;
+        return -1;
+    }
+
+    replaying = true;
+    return 0;
+}
+
+void io_async(void) {
+    ring_wanted = true;
+}
+
+int io_begin(void) {
+    input = {nullptr, nullptr};
+    if(source_scripted) source = script;
+    replay_next = 0;
+
+    output_bytes = 0;
+    output_hash = HASH_INIT;
+    output_ready = false;
+    output = {nullptr, nullptr};
+
+    if(ring_wanted) {
+        ring = (uint8_t *)std::malloc(RING_SIZE);
+        if(!ring) return -1;
+
+        ring_head.store(0, std::memory_order_relaxed);
+        ring_tail.store(0, std::memory_order_relaxed);
+        ring_writer = std::thread(ring_drain);
+    }
+    return 0;
+}
+
+int io_finish(uint64_t steps) {
+    output_close();
+
+    if(record_fp) {
+        fprintf(
+            record_fp, "= %" PRIu64 " %" PRIu64 " %016" PRIx64 "\n",
+            steps, output_bytes, output_hash
+        );
+        fclose(record_fp);
+        record_fp = nullptr;
+    }
+
+    if(replaying) {
+        int status = 0;
+        if(replay_next != replay_count) {
+            fprintf(stderr, "Replay finished without reading all input\n");
+            status = -1;
+        }
+        if(steps != replay_steps) {
+            fprintf(stderr,
+                "Replay ran %" PRIu64 " instructions, recorded %" PRIu64 "\n",
+                steps, replay_steps
+            );
+            status = -1;
+        }
+        if(output_bytes != replay_bytes || output_hash != replay_hash) {
+            fprintf(stderr,
+                "Replay output %" PRIu64 " bytes (%016" PRIx64 "), "
+                "recorded %" PRIu64 " bytes (%016" PRIx64 ")\n",
+                output_bytes, output_hash, replay_bytes, replay_hash
+            );
+            status = -1;
+        }
+        return status;
+    }
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * Shared I/O for the interpreters. Kept C-compatible so hw1.c can use it too.
+ *
+ * OP_INP reads from a buffer that's filled with large `read` calls instead of
+ * going through getchar, and a scripted transcript (--input FILE) is mmapped
+ * and served straight out of the mapping without any syscalls at all. OP_OUT
+ * writes into a buffer which is flushed with `write`, line by line when stdout
+ * is a terminal, or with --async-output into a ring drained by a writer thread.
+ * Output is always completely written before blocking on input.
+ *
+ * Both sides have a fast path that only touches the window [cur, end). Modes
+ * which need to see every byte (--record, --replay) keep the window empty so
+ * everything goes through the slow path.
+ *
+ * Input takes the number of instructions executed so far (including the OP_INP
+ * itself) so a recording can be replayed at exactly the same points.
+**/
+#ifndef IO_H
+#define IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const uint8_t *cur; // Next unread byte
+    const uint8_t *end; // End of the buffered bytes
+} Input;
+
+typedef struct {
+    uint8_t *cur; // Next free byte
+    uint8_t *end; // End of the space which can be written without a flush
+} Output;
+
+extern Input input;
+extern Output output;
+
+/**
+ * Slow path of input_getc, refill the buffer and return the next byte or -1 on
+ * EOF. Flushes output first so prompts are visible before blocking.
+**/
+int input_fill(uint64_t steps);
+
+/**
+ * Slow path of output_putc, makes room in the buffer for c.
+**/
+void output_spill(uint8_t c);
+
+/**
+ * Serve all input from the file at path instead of stdin. Returns 0 on success
+ * or -1 with errno set.
+**/
+int input_open(const char *path);
+
+/**
+ * Log every input byte with the instruction count it was read at, plus a hash
+ * of the output, to the file at path. Returns 0 on success or -1.
+**/
+int io_record(const char *path);
+
+/**
+ * Feed input from a recording made by io_record instead of stdin, failing if
+ * the program asks for input at any other instruction count. Returns 0 on
+ * success or -1.
+**/
+int io_replay(const char *path);
+
+/**
+ * Hand output to a writer thread through a lock-free ring so a slow pipe or
+ * terminal doesn't stall the interpreter. Takes effect from the next io_begin,
+ * which reports it if the thread can't be started.
+**/
+void io_async(void);
+
+/**
+ * Start a run, rewinding a scripted or replayed input so several engines can
+ * be fed the same session one after another. Input read from stdin can't be
+ * rewound, whatever the previous run left unread is dropped. Returns 0 on
+ * success or -1 if the output thread couldn't be started.
+**/
+int io_begin(void);
+
+/**
+ * End a run, flush output and finish the recording or check the output against
+ * the one being replayed. Returns 0 on success or -1 if the replay didn't
+ * match.
+**/
+int io_finish(uint64_t steps);
+
+static inline int input_getc(uint64_t steps) {
+    if(input.cur < input.end) return *input.cur++;
+    return input_fill(steps);
+}
+
+static inline void output_putc(uint8_t c) {
+    if(output.cur < output.end) *output.cur++ = c;
+    else output_spill(c);
+}
+
+static inline void output_write(const uint8_t *s, size_t n) {
+    if((size_t)(output.end - output.cur) >= n) {
+        memcpy(output.cur, s, n);
+        output.cur += n;
+    }
+    else {
+        for(size_t i = 0; i < n; ++i) output_putc(s[i]);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
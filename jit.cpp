@@ -0,0 +1,1050 @@
+/**
+ * Tracing JIT engine (see jit.h). Arrays are kept like try.cpp keeps them, with
+ * the free list in the size field of inactive entries, so identifiers come out
+ * the same as every other engine.
+ *
+ * The interpreter counts how often each prg 0 lands on an address. Once one
+ * gets hot it records from there, one TraceOp per instruction executed, and
+ * stops when
+ *
+ * - a prg 0 goes back to the start, which makes the trace a loop
+ * - a prg 0 lands on another trace, which the trace jumps to when it's done
+ * - it gets to MAX_TRACE instructions
+ * - the next instruction is one the trace can't do (hlt, invalid, prg of a
+ *   non-zero array, or a store to array 0), the trace ends before it
+ *
+ * and the backend compiles it into the code cache, an executable mapping
+ * filled front to back after the backend's trampoline. Traces are found by the
+ * address they start at in s.entries, one per word of array 0, which native
+ * code also uses to jump between traces without coming back here. Each prg 0
+ * in a trace gets an inline cache in s.ics in front of that.
+ *
+ * Every word of array 0 a trace was recorded from is marked, and a store that
+ * changes one of them throws away every trace, as does a prg of a non-zero
+ * array and running out of inline caches. That's rare enough in practice that
+ * it's not worth tracking which traces depend on which words.
+ *
+ * The code cache is jit_size bytes and used as a ring: once a trace doesn't
+ * fit before the end it goes back to the start, and the oldest traces in the
+ * way are evicted. Traces only find each other through s.entries and the
+ * inline caches, so evicting one is clearing its entry and every inline cache
+ * that still points at it. Native code never runs while that happens, since
+ * traces are only compiled and installed from the engine.
+ *
+ * With --jit-thread the backend runs on a thread of its own. A finished
+ * recording is queued for it and the interpreter carries on, then installs the
+ * trace at the first prg 0 after it's compiled. Whatever was queued before a
+ * flush is thrown away when it comes back.
+ *
+ * With --jit-cache DIR the code cache is saved whenever array 0 is about to be
+ * replaced and at the end of the run, in a file named after the hash of array
+ * 0 as it was loaded. Next time that image is loaded the file is mapped over
+ * the code cache as it is, since traces can run from anywhere, as long as it
+ * was written by the same executable and every word it was traced from is
+ * still the same.
+**/
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+#include "jit.h"
+
+#define REG(x) s.registers[x]
+#define REG_I() REG((cur >> 25) & 7)
+#define RA() REG(RX(2, cur))
+#define RB() REG(RX(1, cur))
+#define RC() REG(RX(0, cur))
+#define IMM() (cur & 0x01ffffff) // Immediate value, 25 bits
+
+namespace {
+
+// Times a prg 0 lands on an address before recording from there
+constexpr uint8_t HOT = 64;
+// Counters are shared between addresses with the same low bits
+constexpr reg_t HOT_SIZE = 4096;
+constexpr uint32_t MAX_TRACE = 4096;
+// Inline caches, once they're all used everything is flushed
+constexpr uint32_t MAX_ICS = 1 << 16;
+// Recordings waiting for the compiler thread, more than that are dropped
+constexpr uint32_t MAX_JOBS = 16;
+constexpr uint32_t JOBS_CLOSED = 1u << 31;
+constexpr char CACHE_MAGIC[8] = {'U', 'M', 'J', 'I', 'T', 0, 0, 1};
+
+// Why the interpreter returned
+enum Stop {
+    STOP_DONE, // Halted or failed, jit.error says which
+    STOP_ENTER, // s.pc has a trace
+    STOP_HOT, // Start recording at s.pc
+    STOP_LOAD, // prg of a non-zero array
+    STOP_END, // Recording can't go any further than s.pc
+    STOP_LOOP, // Recording came back to the start
+    STOP_LINK, // Recording landed on another trace
+    STOP_READY // The compiler thread has a trace to install
+};
+
+/**
+ * A recording handed to the compiler thread. Everything but code and size is
+ * filled in before it's queued, those two when it's compiled.
+**/
+struct Job {
+    TraceOp *ops;
+    uint32_t nops;
+    bool loops;
+    reg_t next, start;
+    uint32_t generation; // Jit::generation it was recorded in
+    uint8_t *code;
+    size_t size;
+};
+
+/**
+ * Start of a --jit-cache file. It's followed by an entry offset for each start
+ * pc, then every traced pc with its word, and the code cache from `code` on
+ * (page aligned), starting with the trampoline.
+**/
+struct CacheHeader {
+    char magic[8];
+    uint64_t version; // Hash of the executable that wrote it
+    uint64_t image; // Hash of array 0 when it was loaded
+    reg_t size; // Of array 0
+    uint32_t nics;
+    uint32_t nentries, ntraced;
+    uint64_t used; // Bytes of the code cache
+    uint64_t code; // Offset of the code cache in the file
+};
+
+struct CacheEntry {
+    reg_t pc;
+    uint32_t offset;
+};
+
+struct CacheWord {
+    reg_t pc, word;
+};
+
+// A trace in the code cache, in the order they were put there
+struct Trace {
+    reg_t start;
+    uint32_t offset;
+};
+
+struct Jit {
+    JitState s;
+    const JitBackend *backend;
+    JitCode enter; // The trampoline, at the start of the cache
+    Error error;
+    reg_t ident, target; // Operands of a pending load
+
+    /**
+     * Code cache of `size` bytes, traces go from `base` up. The next one goes
+     * at `used`, and nothing is past `top`. Oldest first, traces[first] up to
+     * traces[ntraces] are still in it.
+    **/
+    uint8_t *cache;
+    size_t size, base, used, top;
+    Trace *traces;
+    uint32_t first, ntraces, maxtraces;
+    uint32_t nics; // Inline caches in use
+
+    // For --stats
+    uint64_t compiled_traces, evicted, flushes, invalidated, loads;
+
+    uint8_t hot[HOT_SIZE];
+    uint8_t *traced; // One per word of array 0, set if a trace came from it
+    uint32_t generation; // Flushes so far
+    uint64_t image; // Hash of array 0 when it was loaded, with --jit-cache
+    reg_t source; // Array that array 0 was last loaded from, for --perf-map
+    bool changed; // Compiled anything since the last save or restore
+
+    // Recording in progress
+    TraceOp *ops;
+    uint32_t nops;
+    reg_t start;
+
+    /**
+     * Ring of jobs for the compiler thread. queued is only written here and
+     * compiled only by the thread, installed is how many of those have been
+     * installed (or dropped).
+    **/
+    std::thread compiler;
+    Job jobs[MAX_JOBS];
+    alignas(64) std::atomic<uint32_t> queued;
+    alignas(64) std::atomic<uint32_t> compiled;
+    uint32_t installed;
+};
+
+Jit jit;
+
+void set_next(JitState &s, reg_t ident, reg_t dst) {
+    s.arrays[ident].size = dst - ident - 1;
+}
+
+reg_t get_next(JitState &s, reg_t ident) {
+    return s.arrays[ident].size + ident + 1;
+}
+
+void *find(reg_t pc) {
+    return pc < jit.s.nentries? jit.s.entries[pc] : nullptr;
+}
+
+/**
+ * Throw away every trace. Native code may still be running (a store from a
+ * trace gets here), which is fine since nothing is written over until the
+ * next compile and it leaves straight away.
+**/
+void flush() {
+    std::memset(jit.s.entries, 0, jit.s.nentries * sizeof(void *));
+    std::memset(jit.traced, 0, jit.s.nentries);
+    jit.used = jit.top = jit.base;
+    jit.first = jit.ntraces = 0;
+    jit.nics = 0;
+    ++jit.generation;
+}
+
+/**
+ * Remember that a trace from `start` was just put at jit.used, and move on
+ * past it.
+**/
+void add_trace(reg_t start, size_t size) {
+    if(jit.ntraces == jit.maxtraces) {
+        if(jit.first > jit.ntraces / 2) {
+            jit.ntraces -= jit.first;
+            std::memmove(
+                jit.traces, jit.traces + jit.first, jit.ntraces * sizeof(Trace)
+            );
+            jit.first = 0;
+        }
+        else {
+            jit.maxtraces = jit.maxtraces? jit.maxtraces * 2 : 256;
+            jit.traces = (Trace *)std::realloc(
+                jit.traces, jit.maxtraces * sizeof(Trace)
+            );
+        }
+    }
+    jit.traces[jit.ntraces++] = {start, (uint32_t)jit.used};
+    jit.s.entries[start] = jit.cache + jit.used;
+    jit.used = (jit.used + size + 15) & ~(size_t)15;
+    if(jit.used > jit.top) jit.top = jit.used;
+    ++jit.compiled_traces;
+    jit.changed = true;
+}
+
+/**
+ * Make room for `size` bytes at jit.used, going back to the start if they
+ * don't fit before the end and evicting the oldest traces in the way. False
+ * if they wouldn't fit even in an empty cache.
+**/
+bool reserve(size_t size) {
+    if(jit.base + size > jit.size) return false;
+
+    uint32_t first = jit.first;
+    if(jit.used + size > jit.size) {
+        // Everything left past here is older than anything before it
+        while(first < jit.ntraces && jit.traces[first].offset >= jit.used) {
+            ++first;
+        }
+        jit.used = jit.base;
+    }
+    while(first < jit.ntraces && jit.traces[first].offset >= jit.used
+        && jit.traces[first].offset < jit.used + size) {
+        ++first;
+    }
+    if(first == jit.first) return true;
+
+    for(; jit.first < first; ++jit.first) {
+        const Trace &trace = jit.traces[jit.first];
+        if(jit.s.entries[trace.start] == jit.cache + trace.offset) {
+            jit.s.entries[trace.start] = nullptr;
+        }
+        ++jit.evicted;
+    }
+    // An inline cache is only good while it agrees with s.entries
+    for(uint32_t i = 0; i < jit.nics; ++i) {
+        JitIc &ic = jit.s.ics[i];
+        for(int j = 0; j < 2; ++j) {
+            if(ic.pc[j] != ~0u && jit.s.entries[ic.pc[j]] != ic.code[j]) {
+                ic.pc[j] = ~0u;
+                ic.code[j] = nullptr;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Name a trace that was just put into the cache for --perf-map, after the
+ * array it was recorded from and the pcs it covers (which need not all be in
+ * between). Traces restored from --jit-cache only know where they start.
+**/
+void map_trace(
+    const uint8_t *code, size_t size, reg_t start, const TraceOp *ops,
+    uint32_t nops
+) {
+    reg_t lo = start, hi = start;
+    for(uint32_t i = 0; i < nops; ++i) {
+        lo = ops[i].pc < lo? ops[i].pc : lo;
+        hi = ops[i].pc > hi? ops[i].pc : hi;
+    }
+    char name[96];
+    if(ops) {
+        std::snprintf(name, sizeof(name), "%s: array %u pc 0x%x [0x%x-0x%x]",
+            jit.backend->name, jit.source, start, lo, hi
+        );
+    }
+    else {
+        std::snprintf(name, sizeof(name), "%s: array %u pc 0x%x cached",
+            jit.backend->name, jit.source, start
+        );
+    }
+    perf_map_code(code, size, name);
+}
+
+/**
+ * Give every prg 0 in the recording a fresh inline cache, false if there
+ * aren't enough left.
+**/
+bool assign_ics() {
+    uint32_t sites = 0;
+    for(uint32_t i = 0; i < jit.nops; ++i) {
+        sites += OPCODE(jit.ops[i].word) == OP_PRG;
+    }
+    if(jit.nics + sites > MAX_ICS) return false;
+
+    for(uint32_t i = 0; i < jit.nops; ++i) {
+        if(OPCODE(jit.ops[i].word) != OP_PRG) continue;
+        jit.ops[i].ic = jit.nics;
+        jit.s.ics[jit.nics++] = {{~0u, ~0u}, {nullptr, nullptr}};
+    }
+    return true;
+}
+
+void compiler_thread() {
+    uint32_t done = 0;
+    for(;;) {
+        uint32_t queued = jit.queued.load(std::memory_order_acquire);
+        if(queued & JOBS_CLOSED) return;
+        if(queued == done) {
+            jit.queued.wait(queued, std::memory_order_acquire);
+            continue;
+        }
+        Job &job = jit.jobs[done % MAX_JOBS];
+        job.code = jit.backend->compile(
+            job.ops, job.nops, job.loops, job.next, &job.size
+        );
+        jit.compiled.store(++done, std::memory_order_release);
+    }
+}
+
+/**
+ * Whether the compiler thread can't take a recording from pc, because there's
+ * one from there already or it has enough to do.
+**/
+bool busy(reg_t pc) {
+    uint32_t queued = jit.queued.load(std::memory_order_relaxed);
+    if(queued - jit.installed == MAX_JOBS) return true;
+    for(uint32_t i = jit.installed; i != queued; ++i) {
+        if(jit.jobs[i % MAX_JOBS].start == pc) return true;
+    }
+    return false;
+}
+
+/**
+ * Queue what was recorded for the compiler thread. Its words are marked
+ * already, so a store to one of them before it's installed throws it away.
+**/
+void submit(bool loops, reg_t next) {
+    uint32_t queued = jit.queued.load(std::memory_order_relaxed);
+    Job &job = jit.jobs[queued % MAX_JOBS];
+    job.ops = (TraceOp *)std::malloc(jit.nops * sizeof(TraceOp));
+    std::memcpy(job.ops, jit.ops, jit.nops * sizeof(TraceOp));
+    job.nops = jit.nops;
+    job.loops = loops;
+    job.next = next;
+    job.start = jit.start;
+    job.generation = jit.generation;
+    for(uint32_t i = 0; i < jit.nops; ++i) jit.traced[jit.ops[i].pc] = 1;
+    jit.queued.store(queued + 1, std::memory_order_release);
+    jit.queued.notify_one();
+}
+
+/**
+ * Install everything the compiler thread has finished. A trace from before
+ * the last flush is stale and dropped, it'll be recorded again when it gets
+ * hot.
+**/
+void install() {
+    uint32_t compiled = jit.compiled.load(std::memory_order_acquire);
+    for(; jit.installed != compiled; ++jit.installed) {
+        Job &job = jit.jobs[jit.installed % MAX_JOBS];
+        if(job.generation == jit.generation && reserve(job.size)) {
+            std::memcpy(jit.cache + jit.used, job.code, job.size);
+            map_trace(
+                jit.cache + jit.used, job.size, job.start, job.ops, job.nops
+            );
+            add_trace(job.start, job.size);
+        }
+        std::free(job.ops);
+        std::free(job.code);
+    }
+}
+
+/**
+ * Stop the compiler thread and drop whatever it hasn't compiled or the
+ * interpreter hasn't installed.
+**/
+void stop_compiler() {
+    jit.queued.fetch_or(JOBS_CLOSED, std::memory_order_release);
+    jit.queued.notify_one();
+    jit.compiler.join();
+
+    uint32_t queued = jit.queued.load(std::memory_order_relaxed) & ~JOBS_CLOSED;
+    uint32_t compiled = jit.compiled.load(std::memory_order_relaxed);
+    for(; jit.installed != queued; ++jit.installed) {
+        Job &job = jit.jobs[jit.installed % MAX_JOBS];
+        std::free(job.ops);
+        if(jit.installed < compiled) std::free(job.code);
+    }
+}
+
+// FNV-1a, like aot_hash but over bytes
+uint64_t hash(const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < size; ++i) h = (h ^ bytes[i]) * 0x100000001b3ull;
+    return h;
+}
+
+/**
+ * Hash of this executable, so a different build never uses the files of
+ * another. 0 if it can't be read, which turns --jit-cache off.
+**/
+uint64_t version() {
+    static uint64_t cached = ~0ull;
+    if(cached != ~0ull) return cached;
+    cached = 0;
+
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if(fd < 0) return cached;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *exe = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(exe != MAP_FAILED) {
+            cached = hash(exe, st.st_size) | 1;
+            munmap(exe, st.st_size);
+        }
+    }
+    close(fd);
+    return cached;
+}
+
+void cache_path(char *path, size_t size) {
+    std::snprintf(
+        path, size, "%s/%016" PRIx64 "-%s.jit", jit_cache, jit.image,
+        jit.backend->name
+    );
+}
+
+/**
+ * Write the code cache to --jit-cache if anything was compiled into it since
+ * it was restored. It's written next to the file and renamed over it, so
+ * other processes only ever see a whole one.
+**/
+void save() {
+    if(!jit_cache || !jit.cache || !jit.changed || !version()) return;
+    jit.changed = false;
+
+    const JitState &s = jit.s;
+    CacheHeader header = {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = version();
+    header.image = jit.image;
+    header.size = s.arrays[0].size;
+    header.nics = jit.nics;
+    header.used = jit.top;
+    for(reg_t pc = 0; pc < s.nentries; ++pc) {
+        header.nentries += s.entries[pc] != nullptr;
+        header.ntraced += jit.traced[pc];
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    header.code = sizeof(header) + header.nentries * sizeof(CacheEntry)
+        + header.ntraced * sizeof(CacheWord);
+    header.code = (header.code + page - 1) / page * page;
+
+    char path[4096], tmp[4096 + 32];
+    cache_path(path, sizeof(path));
+    std::snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *fp = std::fopen(tmp, "wb");
+    if(!fp) {
+        perror("Failed to save the JIT cache");
+        return;
+    }
+    std::fwrite(&header, sizeof(header), 1, fp);
+    for(reg_t pc = 0; pc < s.nentries; ++pc) {
+        if(!s.entries[pc]) continue;
+        CacheEntry entry = {pc, (uint32_t)((uint8_t *)s.entries[pc] - jit.cache)};
+        std::fwrite(&entry, sizeof(entry), 1, fp);
+    }
+    for(reg_t pc = 0; pc < s.nentries; ++pc) {
+        if(!jit.traced[pc]) continue;
+        CacheWord word = {pc, s.arrays[0].data[pc]};
+        std::fwrite(&word, sizeof(word), 1, fp);
+    }
+    // Whole pages, so the last one maps without running past the end
+    std::fseek(fp, header.code, SEEK_SET);
+    std::fwrite(jit.cache, 1, jit.top, fp);
+    for(size_t i = jit.top; i % page; ++i) std::fputc(0, fp);
+    if(std::fclose(fp) != 0 || std::rename(tmp, path) != 0) {
+        perror("Failed to save the JIT cache");
+        std::remove(tmp);
+    }
+}
+
+/**
+ * Map what save wrote for the array 0 just loaded over the empty code cache,
+ * if there is anything and it still applies.
+**/
+void restore() {
+    if(!jit_cache || !jit.cache || !version()) return;
+
+    char path[4096];
+    cache_path(path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return;
+
+    JitState &s = jit.s;
+    CacheHeader header;
+    CacheEntry *entries = nullptr;
+    CacheWord *words = nullptr;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0
+        && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && std::memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.version == version() && header.image == jit.image
+        && header.size == s.arrays[0].size && header.nics <= MAX_ICS
+        && header.used >= jit.base && header.used <= jit.size
+        && (uint64_t)st.st_size >= header.code + header.used;
+    if(ok) {
+        size_t nentries = header.nentries * sizeof(CacheEntry);
+        size_t ntraced = header.ntraced * sizeof(CacheWord);
+        entries = (CacheEntry *)std::malloc(nentries + 1);
+        words = (CacheWord *)std::malloc(ntraced + 1);
+        ok = pread(fd, entries, nentries, sizeof(header)) == (ssize_t)nentries
+            && pread(fd, words, ntraced, sizeof(header) + nentries)
+                == (ssize_t)ntraced;
+    }
+    for(uint32_t i = 0; ok && i < header.ntraced; ++i) {
+        ok = words[i].pc < s.nentries
+            && s.arrays[0].data[words[i].pc] == words[i].word;
+    }
+    for(uint32_t i = 0; ok && i < header.nentries; ++i) {
+        ok = entries[i].pc < s.nentries && entries[i].offset >= jit.base
+            && entries[i].offset < header.used;
+    }
+    if(ok) {
+        // Private, so traces compiled from here on don't end up in the file
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t mapped = (header.used + page - 1) / page * page;
+        ok = mmap(
+            jit.cache, mapped, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_FIXED, fd, header.code
+        ) != MAP_FAILED;
+    }
+    if(ok) {
+        for(uint32_t i = 0; i < header.nentries; ++i) {
+            s.entries[entries[i].pc] = jit.cache + entries[i].offset;
+        }
+        // Each trace runs up to the next one, the padding in between with it.
+        // Which were oldest is lost, they'll be evicted front to back.
+        std::sort(entries, entries + header.nentries,
+            [](const CacheEntry &a, const CacheEntry &b) {
+                return a.offset < b.offset;
+            }
+        );
+        if(header.nentries > jit.maxtraces) {
+            jit.maxtraces = header.nentries;
+            jit.traces = (Trace *)std::realloc(
+                jit.traces, jit.maxtraces * sizeof(Trace)
+            );
+        }
+        for(uint32_t i = 0; i < header.nentries; ++i) {
+            uint32_t end = i + 1 < header.nentries?
+                entries[i + 1].offset : header.used;
+            jit.traces[i] = {entries[i].pc, entries[i].offset};
+            map_trace(
+                jit.cache + entries[i].offset, end - entries[i].offset,
+                entries[i].pc, nullptr, 0
+            );
+        }
+        jit.first = 0;
+        jit.ntraces = header.nentries;
+        for(uint32_t i = 0; i < header.ntraced; ++i) {
+            jit.traced[words[i].pc] = 1;
+        }
+        for(uint32_t i = 0; i < header.nics; ++i) {
+            s.ics[i] = {{~0u, ~0u}, {nullptr, nullptr}};
+        }
+        jit.nics = header.nics;
+        jit.used = jit.top = header.used;
+        jit.changed = false;
+    }
+    std::free(entries);
+    std::free(words);
+    close(fd);
+}
+
+/**
+ * Compile what was recorded into the cache, or queue it with --jit-thread.
+ * Recordings of nothing, and ones that don't fit even in an empty cache, are
+ * dropped.
+**/
+void compile(bool loops, reg_t next) {
+    if(jit.nops == 0) return;
+    if(!assign_ics()) {
+        flush();
+        ++jit.flushes;
+        if(!assign_ics()) return;
+    }
+    if(jit_thread) {
+        submit(loops, next);
+        return;
+    }
+
+    size_t size;
+    uint8_t *code = jit.backend->compile(jit.ops, jit.nops, loops, next, &size);
+    if(reserve(size)) {
+        std::memcpy(jit.cache + jit.used, code, size);
+        map_trace(jit.cache + jit.used, size, jit.start, jit.ops, jit.nops);
+        add_trace(jit.start, size);
+        for(uint32_t i = 0; i < jit.nops; ++i) jit.traced[jit.ops[i].pc] = 1;
+    }
+    std::free(code);
+}
+
+void check_arrays(void *ctx) {
+    JitState &s = *(JitState *)ctx;
+    for(reg_t i = 0; i < s.narrays; ++i) {
+        if(s.arrays[i].data) check_array(i, s.arrays[i].data, s.arrays[i].size);
+    }
+}
+
+reg_t new_array(JitState *s, reg_t size) {
+    reg_t ident = s->free;
+    if(ident) {
+        s->free = get_next(*s, ident);
+    }
+    else {
+        ident = s->narrays;
+        s->free = ident + 1;
+        s->narrays *= 2;
+        s->arrays = (JitArray *)std::realloc(
+            s->arrays, s->narrays * sizeof(JitArray)
+        );
+        std::memset(&s->arrays[ident], 0, ident * sizeof(JitArray));
+        set_next(*s, s->narrays - 1, 0);
+    }
+    s->arrays[ident].size = size;
+    s->arrays[ident].data = size? (reg_t *)std::calloc(size, sizeof(reg_t)) : nullptr;
+    return ident;
+}
+
+void del_array(JitState *s, reg_t ident) {
+    std::free(s->arrays[ident].data);
+    s->arrays[ident].data = nullptr;
+    set_next(*s, ident, s->free);
+    s->free = ident;
+}
+
+int store_code(JitState *s, reg_t b, reg_t c) {
+    JitArray &prog = s->arrays[0];
+    if(b >= prog.size) return 1;
+    if(prog.data[b] == c) return 0;
+    prog.data[b] = c;
+    if(!jit.traced[b]) return 0;
+    flush();
+    ++jit.invalidated;
+    return 2;
+}
+
+void out(reg_t c) {
+    output_putc(c);
+}
+
+void out_string(const uint8_t *s, reg_t n) {
+    output_write(s, n);
+}
+
+reg_t inp(JitState *s) {
+    return input_getc(s->steps);
+}
+
+void next_event(JitState *s) {
+    s->event = check_next < perf_next? check_next : perf_next;
+}
+
+void event_at(JitState *s, reg_t pc, reg_t cur) {
+    PERF_CHECK(s->steps);
+    CHECK_POINT(s->steps, pc, cur, s->registers, check_arrays, s);
+    next_event(s);
+}
+
+/**
+ * prg of a non-zero array, failing like try.cpp does.
+**/
+Error load(JitState &s, reg_t ident) {
+    if(ident >= s.narrays) return ERR_ARR;
+
+    const JitArray &origin = s.arrays[ident];
+    if(origin.data == nullptr) return ERR_PRG;
+    save();
+
+    JitArray &prog = s.arrays[0];
+    prog.size = origin.size;
+    prog.data = (reg_t *)std::realloc(prog.data, prog.size * sizeof(reg_t) + 1);
+    std::memcpy(prog.data, origin.data, prog.size * sizeof(reg_t));
+    jit.traced = (uint8_t *)std::realloc(jit.traced, prog.size + 1);
+    s.entries = (void **)std::realloc(s.entries, (prog.size + 1) * sizeof(void *));
+    s.nentries = prog.size;
+    flush();
+    ++jit.loads;
+    jit.source = ident;
+    if(jit_cache) {
+        jit.image = hash(prog.data, prog.size * sizeof(reg_t));
+        restore();
+    }
+    return ERR_OK;
+}
+
+/**
+ * Switch based interpreter for everything without a trace. It returns at the
+ * first prg 0 that lands on a trace or gets an address hot, and with RECORD
+ * it also appends every instruction to jit.ops and returns when the recording
+ * is done.
+**/
+template<bool RECORD>
+Stop interpret(JitState &s) {
+    reg_t pc = s.pc;
+    uint64_t steps = s.steps;
+    Stop stop = STOP_DONE;
+
+    while(pc < s.arrays[0].size) {
+        reg_t cur = s.arrays[0].data[pc];
+        if constexpr(RECORD) {
+            int op = OPCODE(cur);
+            if(op == OP_HLT || op > OP_LDI || (op == OP_PRG && RB())
+                || (op == OP_STA && RA() == 0) || jit.nops == MAX_TRACE) {
+                stop = STOP_END;
+                goto leave;
+            }
+            jit.ops[jit.nops++] = {pc, cur, 0, 0, 0};
+        }
+        ++pc;
+        ++steps;
+
+        switch(OPCODE(cur)) {
+            case OP_MOV:
+                RA() = RC()? RB() : RA();
+                break;
+
+            case OP_LDA: {
+                reg_t b = RB(), c = RC();
+                if(b >= s.narrays) goto fail_arr;
+                const JitArray &array = s.arrays[b];
+                if(array.data == nullptr || c >= array.size) goto fail_arr;
+                RA() = array.data[c];
+                break;
+            }
+
+            case OP_STA: {
+                reg_t a = RA(), b = RB();
+                if(a == 0) {
+                    if(store_code(&s, b, RC()) == 1) goto fail_arr;
+                    break;
+                }
+                if(a >= s.narrays) goto fail_arr;
+                const JitArray &array = s.arrays[a];
+                if(array.data == nullptr || b >= array.size) goto fail_arr;
+                array.data[b] = RC();
+                break;
+            }
+
+            case OP_ADD:
+                RA() = RB() + RC();
+                break;
+
+            case OP_MUL:
+                RA() = RB() * RC();
+                break;
+
+            case OP_DIV: {
+                reg_t c = RC();
+                if constexpr(RECORD) {
+                    jit.ops[jit.nops - 1].divisor = c;
+                }
+                if(c == 0) {
+                    jit.error = ERR_DIV;
+                    goto leave;
+                }
+                RA() = RB() / c;
+                break;
+            }
+
+            case OP_NAN:
+                RA() = ~(RB() & RC());
+                break;
+
+            case OP_HLT:
+                jit.error = ERR_OK;
+                goto leave;
+
+            case OP_NEW:
+                RB() = new_array(&s, RC());
+                break;
+
+            case OP_DEL:
+                if(RC() == 0) {
+                    jit.error = ERR_DEL;
+                    goto leave;
+                }
+                del_array(&s, RC());
+                break;
+
+            case OP_OUT:
+                if(RC() > 0xff) {
+                    jit.error = ERR_CHR;
+                    goto leave;
+                }
+                output_putc(RC());
+                break;
+
+            case OP_INP:
+                RC() = input_getc(steps);
+                break;
+
+            case OP_PRG: {
+                PERF_CHECK(steps);
+                s.steps = steps;
+                CHECK_POINT(steps, pc, cur, s.registers, check_arrays, &s);
+                if(RB()) {
+                    jit.ident = RB();
+                    jit.target = RC();
+                    stop = STOP_LOAD;
+                    goto leave;
+                }
+                pc = RC();
+                if constexpr(RECORD) {
+                    jit.ops[jit.nops - 1].target = pc;
+                    if(pc == jit.start) stop = STOP_LOOP;
+                    else if(find(pc)) stop = STOP_LINK;
+                    else break;
+                    goto leave;
+                }
+                else {
+                    if(find(pc)) stop = STOP_ENTER;
+                    // Without a cache nothing is recorded, so nothing's hot
+                    else if(jit.cache && ++jit.hot[pc % HOT_SIZE] >= HOT) {
+                        stop = STOP_HOT;
+                    }
+                    else if(jit.installed != jit.compiled.load(
+                        std::memory_order_relaxed
+                    )) stop = STOP_READY;
+                    else break;
+                    goto leave;
+                }
+            }
+
+            case OP_LDI:
+                REG_I() = IMM();
+                break;
+
+            default:
+                jit.error = ERR_INV;
+                goto leave;
+        }
+    }
+    jit.error = ERR_EOF;
+    goto leave;
+
+fail_arr:
+    jit.error = ERR_ARR;
+leave:
+    s.pc = pc;
+    s.steps = steps;
+    return stop;
+}
+
+/**
+ * Record from s.pc and compile the result. Anything that goes wrong while
+ * recording just ends the recording, the instruction it went wrong at is run
+ * again by the interpreter.
+**/
+Stop record(JitState &s) {
+    jit.start = s.pc;
+    jit.nops = 0;
+    jit.hot[s.pc % HOT_SIZE] = 0;
+    if(jit_thread && busy(s.pc)) return STOP_ENTER;
+
+    Stop stop = interpret<true>(s);
+    switch(stop) {
+        case STOP_END:
+            compile(false, s.pc);
+            return STOP_ENTER;
+
+        case STOP_LOOP:
+            compile(true, 0);
+            return STOP_ENTER;
+
+        case STOP_LINK:
+            compile(false, 0);
+            return STOP_ENTER;
+
+        default:
+            return stop;
+    }
+}
+
+Error run(
+    const reg_t *code, reg_t size, uint64_t *steps, const JitBackend &backend
+) {
+    JitState &s = jit.s;
+    s = {};
+    jit.backend = &backend;
+    s.narrays = 256;
+    s.arrays = (JitArray *)std::calloc(s.narrays, sizeof(JitArray));
+    s.arrays[0].size = size;
+    s.arrays[0].data = (reg_t *)std::malloc(size * sizeof(reg_t) + 1);
+    if(size) std::memcpy(s.arrays[0].data, code, size * sizeof(reg_t));
+    s.free = 1;
+    set_next(s, s.narrays - 1, 0);
+
+    s.new_array = new_array;
+    s.del_array = del_array;
+    s.store_code = store_code;
+    s.out = out;
+    s.out_string = out_string;
+    s.inp = inp;
+    s.event_at = event_at;
+
+    jit.size = jit_size;
+    void *cache = mmap(
+        nullptr, jit.size, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    jit.cache = cache == MAP_FAILED? nullptr : (uint8_t *)cache;
+    jit.base = jit.used = jit.top = jit.nics = 0;
+    jit.first = jit.ntraces = 0;
+    jit.compiled_traces = jit.evicted = jit.flushes = 0;
+    jit.invalidated = jit.loads = 0;
+    if(jit.cache) {
+        size_t size;
+        uint8_t *trampoline = backend.trampoline(&size);
+        if(size > jit.size) {
+            // Everything is interpreted, like without a cache at all
+            munmap(jit.cache, jit.size);
+            jit.cache = nullptr;
+        }
+        else {
+            std::memcpy(jit.cache, trampoline, size);
+            char name[32];
+            std::snprintf(name, sizeof(name), "%s: trampoline", backend.name);
+            perf_map_code(jit.cache, size, name);
+            jit.enter = (JitCode)jit.cache;
+            jit.base = jit.used = jit.top = (size + 15) & ~(size_t)15;
+        }
+        std::free(trampoline);
+    }
+    s.entries = (void **)std::calloc(size + 1, sizeof(void *));
+    s.nentries = size;
+    s.ics = (JitIc *)std::malloc(MAX_ICS * sizeof(JitIc));
+    std::memset(jit.hot, 0, sizeof(jit.hot));
+    jit.traced = (uint8_t *)std::calloc(size + 1, 1);
+    jit.ops = (TraceOp *)std::malloc(MAX_TRACE * sizeof(TraceOp));
+    jit.generation = 0;
+    jit.queued.store(0, std::memory_order_relaxed);
+    jit.compiled.store(0, std::memory_order_relaxed);
+    jit.installed = 0;
+    if(jit_thread && jit.cache) jit.compiler = std::thread(compiler_thread);
+    jit.changed = false;
+    jit.source = 0;
+    if(jit_cache) {
+        if(jit.cache) mkdir(jit_cache, 0777);
+        jit.image = hash(code, size * sizeof(reg_t));
+        restore();
+    }
+
+    perf_phase(PERF_EXEC);
+    for(;;) {
+        if(void *trace = find(s.pc)) {
+            next_event(&s);
+            if(jit.enter(&s, trace) == JIT_JUMP) continue;
+        }
+
+        Stop stop = interpret<false>(s);
+        if(stop == STOP_READY) {
+            install();
+            continue;
+        }
+        if(stop == STOP_HOT) stop = record(s);
+        if(stop == STOP_DONE) break;
+        if(stop == STOP_LOAD) {
+            if((jit.error = load(s, jit.ident)) != ERR_OK) break;
+            s.pc = jit.target;
+        }
+    }
+    perf_phase(PERF_TEARDOWN);
+
+    CHECK_DONE(s.steps, jit.error, s.pc, s.registers, check_arrays, &s);
+    *steps = s.steps;
+
+    if(jit.compiler.joinable()) stop_compiler();
+    save();
+    if(jit.cache) munmap(jit.cache, jit.size);
+    if(jit_stats) {
+        fprintf(stderr,
+            "%s cache: %" PRIu64 " traces, %" PRIu64 " evicted, %" PRIu64
+            " flushes, %" PRIu64 " invalidated by stores, %" PRIu64
+            " by loads, %zu of %zu KiB used\n",
+            backend.name, jit.compiled_traces, jit.evicted, jit.flushes,
+            jit.invalidated, jit.loads, jit.top >> 10, jit.size >> 10
+        );
+    }
+    std::free(s.entries);
+    std::free(jit.traces);
+    jit.traces = nullptr;
+    jit.maxtraces = 0;
+    std::free(s.ics);
+    std::free(jit.traced);
+    std::free(jit.ops);
+    for(reg_t i = 0; i < s.narrays; ++i) {
+        std::free(s.arrays[i].data);
+    }
+    std::free(s.arrays);
+    return jit.error;
+}
+
+}
+
+bool jit_thread = false;
+const char *jit_cache = nullptr;
+size_t jit_size = 64 << 20;
+bool jit_stats = false;
+
+Error jit_run(const reg_t *code, reg_t size, uint64_t *steps) {
+    return run(code, size, steps, x64_backend);
+}
+
+Error cnp_run(const reg_t *code, reg_t size, uint64_t *steps) {
+    return run(code, size, steps, cnp_backend);
+}
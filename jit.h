@@ -0,0 +1,120 @@
+/**
+ * Tracing JIT (--engine=jit). The engine in jit.cpp interprets until a prg 0
+ * has landed on the same address often enough, then records the path the
+ * program takes from there, following prg 0 jumps, until it comes back around
+ * (or runs into a trace that's already compiled, or gets too long). x64.cpp
+ * (or cnp.cpp, with --engine=cnp) compiles the recording to a native loop with
+ * a guard on the target of every prg 0 along the way, and on anything that
+ * would fail.
+ *
+ * Native code never ends the run itself. A guard that fails, or an
+ * instruction that would fail, leaves it with the pc of where to continue and
+ * the engine interprets from there, so every error is raised by the
+ * interpreter exactly like the other engines do.
+ *
+ * Native code only reaches the runtime through the function pointers in
+ * JitState, and other code through JitState's tables, so it can be copied
+ * anywhere. A prg 0 that doesn't go where it went while recording tries its
+ * inline cache, then the table of traces by pc, and only leaves if neither has
+ * anything.
+**/
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "um.h"
+
+struct JitArray {
+    reg_t size;
+    reg_t *data; // nullptr if inactive or empty
+};
+
+/**
+ * Inline cache of one prg 0 site, the two most recent targets it jumped to
+ * that had traces, most recent first. Empty slots hold 0xffffffff, which is
+ * never looked up since it's past the end of any array 0.
+**/
+struct JitIc {
+    reg_t pc[2];
+    void *code[2];
+};
+
+struct JitState {
+    reg_t registers[8];
+    reg_t pc;
+    uint64_t steps;
+    uint64_t event; // Instruction count of the next checkpoint or perf sample
+
+    JitArray *arrays;
+    reg_t narrays;
+    reg_t free; // Head of the free list, same scheme as try.cpp
+
+    // Trace starting at each word of array 0, or nullptr
+    void **entries;
+    reg_t nentries;
+    JitIc *ics; // Indexed by TraceOp::ic
+
+    reg_t (*new_array)(JitState *s, reg_t size);
+    void (*del_array)(JitState *s, reg_t ident);
+    // Store to array 0, returns 0, 1 on ERR_ARR or 2 if compiled code changed
+    int (*store_code)(JitState *s, reg_t b, reg_t c);
+    void (*out)(reg_t c);
+    void (*out_string)(const uint8_t *s, reg_t n);
+    reg_t (*inp)(JitState *s); // Reads s->steps
+    void (*event_at)(JitState *s, reg_t pc, reg_t cur); // Reads s->steps
+};
+
+// What native code returns
+enum JitExit {
+    JIT_JUMP, // A prg 0 went to pc
+    JIT_INTERP // Anything else, pc has to be interpreted
+};
+
+/**
+ * Traces jump straight into each other, so they aren't functions themselves.
+ * They're run through the backend's trampoline, which is.
+**/
+typedef JitExit (*JitCode)(JitState *s, void *trace);
+
+/**
+ * One recorded instruction. target is where a prg 0 went while recording and
+ * ic its inline cache, divisor what a div divided by.
+**/
+struct TraceOp {
+    reg_t pc;
+    reg_t word;
+    reg_t target;
+    uint32_t ic;
+    reg_t divisor;
+};
+
+struct JitBackend {
+    /**
+     * Compile a recording to native code in a malloc'd buffer of *size bytes.
+     * With `loops` the last op is a prg 0 back to the first, otherwise the
+     * code leaves at the end with pc set to `next` (or goes wherever a final
+     * prg 0 goes).
+    **/
+    uint8_t *(*compile)(
+        const TraceOp *ops, uint32_t nops, bool loops, reg_t next, size_t *size
+    );
+    // The JitCode every trace is entered through, in a malloc'd buffer
+    uint8_t *(*trampoline)(size_t *size);
+    const char *name; // Of the engine, for --jit-cache files
+};
+
+extern const JitBackend x64_backend; // x64.cpp
+extern const JitBackend cnp_backend; // cnp.cpp
+
+// Compile on a thread of its own instead of in between instructions
+extern bool jit_thread;
+// Directory to save compiled traces in and load them from, or nullptr
+extern const char *jit_cache;
+// Bytes of native code the code cache holds before it evicts old traces
+extern size_t jit_size;
+// Print what happened to the code cache at the end of each run
+extern bool jit_stats;
+
+#endif
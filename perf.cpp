@@ -0,0 +1,262 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cinttypes>
+#include <cerrno>
+
+#include <ctime>
+
+#include <elf.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+struct Counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+#define CACHE(cache, result) (PERF_TYPE_HW_CACHE), \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+static const Counter counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1D-misses", CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"LLC-misses", CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"dTLB-misses", CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    // Software, so there's something even without a PMU (eg in a VM)
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+};
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static const char *phase_names[PERF_PHASES] = {"load", "exec", "teardown"};
+
+uint64_t perf_next = UINT64_MAX;
+
+static int fds[NCOUNTERS];
+static bool opened = false;
+static uint64_t interval = 0;
+
+static PerfPhase phase = PERF_DONE;
+static double last[NCOUNTERS]; // Readings at the start of the current phase
+static double totals[PERF_PHASES][NCOUNTERS];
+static double interval_start[NCOUNTERS];
+static uint64_t interval_steps;
+
+/**
+ * Counters are opened separately rather than as a group so one the PMU can't
+ * do doesn't take the rest down with it. With more events than hardware
+ * counters the kernel multiplexes them, so readings are scaled up by the
+ * fraction of time each was actually counting.
+**/
+static void read_all(double *out) {
+    for(size_t i = 0; i < NCOUNTERS; ++i) {
+        uint64_t buf[3]; // value, time enabled, time running
+        if(fds[i] < 0 || read(fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+            out[i] = 0;
+            continue;
+        }
+        out[i] = buf[2]? (double)buf[0] * buf[1] / buf[2] : 0;
+    }
+}
+
+int perf_open(uint64_t every) {
+    for(size_t i = 0; i < NCOUNTERS; ++i) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // Only the interpreter, which is also all perf_event_paranoid=2 allows
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if(fds[i] < 0) {
+            fprintf(stderr, "perf: %s unavailable (%s)\n",
+                counters[i].name, strerror(errno)
+            );
+        }
+        else {
+            opened = true;
+        }
+    }
+
+    interval = every;
+    return opened? 0 : -1;
+}
+
+void perf_phase(PerfPhase next) {
+    if(!opened) return;
+
+    double now[NCOUNTERS];
+    read_all(now);
+    if(phase != PERF_DONE) {
+        for(size_t i = 0; i < NCOUNTERS; ++i) {
+            totals[phase][i] += now[i] - last[i];
+        }
+    }
+    std::memcpy(last, now, sizeof(now));
+    phase = next;
+
+    if(next == PERF_EXEC && interval) {
+        std::memcpy(interval_start, now, sizeof(now));
+        interval_steps = 0;
+        perf_next = interval;
+    }
+    else {
+        perf_next = UINT64_MAX;
+    }
+}
+
+static void print_counts(const double *counts, uint64_t steps) {
+    for(size_t i = 0; i < NCOUNTERS; ++i) {
+        if(fds[i] < 0) continue;
+        fprintf(stderr, " %14.0f", counts[i]);
+    }
+    if(steps && fds[0] >= 0) {
+        fprintf(stderr, " %8.2f", counts[0] / steps);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void print_header(const char *first) {
+    fprintf(stderr, "%-16s", first);
+    for(size_t i = 0; i < NCOUNTERS; ++i) {
+        if(fds[i] < 0) continue;
+        fprintf(stderr, " %14s", counters[i].name);
+    }
+    if(fds[0] >= 0) fprintf(stderr, " %8s", "cyc/UM");
+    fprintf(stderr, "\n");
+}
+
+void perf_interval(uint64_t steps) {
+    double now[NCOUNTERS], delta[NCOUNTERS];
+    read_all(now);
+    for(size_t i = 0; i < NCOUNTERS; ++i) {
+        delta[i] = now[i] - interval_start[i];
+    }
+    std::memcpy(interval_start, now, sizeof(now));
+
+    if(interval_steps == 0) print_header("perf interval");
+    fprintf(stderr, "@%-15" PRIu64, steps);
+    print_counts(delta, steps - interval_steps);
+
+    interval_steps = steps;
+    perf_next = steps - steps % interval + interval;
+}
+
+void perf_report(const char *engine, uint64_t steps) {
+    if(!opened) return;
+
+    char title[32];
+    snprintf(title, sizeof(title), "perf %s", engine);
+    print_header(title);
+    for(int p = 0; p < PERF_PHASES; ++p) {
+        fprintf(stderr, "  %-14s", phase_names[p]);
+        // Only execution is meaningfully per UM instruction
+        print_counts(totals[p], p == PERF_EXEC? steps : 0);
+    }
+    std::memset(totals, 0, sizeof(totals));
+}
+
+/**
+ * jitdump as described in tools/perf/Documentation/jitdump-specification.txt
+ * in the kernel tree, just the header and a code load record per trace.
+ * Timestamps have to be on the clock perf records with, so that needs
+ * `perf record -k mono`.
+**/
+constexpr uint32_t JITDUMP_MAGIC = 0x4A695444;
+constexpr uint32_t JIT_CODE_LOAD = 0;
+constexpr uint32_t JIT_CODE_CLOSE = 3;
+
+struct JitdumpHeader {
+    uint32_t magic, version, total_size, elf_mach, pad1, pid;
+    uint64_t timestamp, flags;
+};
+
+struct JitdumpRecord {
+    uint32_t id, total_size;
+    uint64_t timestamp;
+};
+
+struct JitdumpLoad {
+    JitdumpRecord record;
+    uint32_t pid, tid;
+    uint64_t vma, code_addr, code_size, code_index;
+    // Followed by the name with its terminator, then the code
+};
+
+static FILE *map_file = nullptr;
+static FILE *dump_file = nullptr;
+static void *dump_marker = nullptr;
+static uint64_t code_index = 0;
+
+static uint64_t timestamp() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int perf_map_open(int jitdump) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    map_file = fopen(path, "w");
+    if(!map_file || !jitdump) return map_file? 0 : -1;
+
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+    dump_file = fopen(path, "w+");
+    if(!dump_file) return -1;
+
+    JitdumpHeader header = {
+        JITDUMP_MAGIC, 1, sizeof(header), EM_X86_64, 0, (uint32_t)getpid(),
+        timestamp(), 0
+    };
+    fwrite(&header, sizeof(header), 1, dump_file);
+    fflush(dump_file);
+    // perf finds the file through this mapping showing up in the recording
+    dump_marker = mmap(
+        nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE,
+        fileno(dump_file), 0
+    );
+    if(dump_marker == MAP_FAILED) dump_marker = nullptr;
+    return dump_marker? 0 : -1;
+}
+
+void perf_map_code(const void *code, size_t size, const char *name) {
+    if(map_file) {
+        fprintf(map_file, "%" PRIxPTR " %zx %s\n", (uintptr_t)code, size, name);
+        fflush(map_file);
+    }
+    if(dump_file) {
+        size_t length = strlen(name) + 1;
+        JitdumpLoad load = {
+            {JIT_CODE_LOAD, (uint32_t)(sizeof(load) + length + size), timestamp()},
+            (uint32_t)getpid(), (uint32_t)gettid(),
+            (uintptr_t)code, (uintptr_t)code, size, code_index++
+        };
+        fwrite(&load, sizeof(load), 1, dump_file);
+        fwrite(name, length, 1, dump_file);
+        fwrite(code, size, 1, dump_file);
+    }
+}
+
+void perf_map_close() {
+    if(map_file) fclose(map_file);
+    if(dump_file) {
+        JitdumpRecord close = {JIT_CODE_CLOSE, sizeof(close), timestamp()};
+        fwrite(&close, sizeof(close), 1, dump_file);
+        fclose(dump_file);
+    }
+    if(dump_marker) munmap(dump_marker, sysconf(_SC_PAGESIZE));
+    map_file = dump_file = nullptr;
+    dump_marker = nullptr;
+}
@@ -0,0 +1,87 @@
+/**
+ * Hardware counters (perf_event_open) for --perf. Each run is split into
+ * phases by the engine: load (copying the image and setting up memory),
+ * execution and teardown, and counts are reported per phase. Kept
+ * C-compatible so hw1.c can mark its phases too.
+ *
+ * With an interval the engines also call perf_interval from OP_PRG once they
+ * pass perf_next instructions, so execution is broken down further without
+ * adding a check to every dispatch. PRG is the only way to loop so samples
+ * land shortly after each interval boundary.
+ *
+ * perf_map_open is separate from the counters and tells `perf record` where
+ * JIT compiled code came from, in /tmp/perf-PID.map and optionally a jitdump
+ * (/tmp/jit-PID.dump) for `perf inject --jit`.
+**/
+#ifndef PERF_H
+#define PERF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PERF_LOAD = 0,
+    PERF_EXEC,
+    PERF_TEARDOWN,
+    PERF_DONE,
+    PERF_PHASES = PERF_DONE
+} PerfPhase;
+
+// Instruction count of the next interval sample, never reached if disabled
+extern uint64_t perf_next;
+
+/**
+ * Open the counters, sampling every `interval` UM instructions if non-zero.
+ * Counters the CPU or kernel don't support are left out. Returns 0 if at
+ * least one could be opened or -1.
+**/
+int perf_open(uint64_t interval);
+
+/**
+ * Attribute everything counted since the last call to the phase that just
+ * ended and start `phase`. No-op unless perf_open succeeded.
+**/
+void perf_phase(PerfPhase phase);
+
+/**
+ * Slow path of the interval check, prints the counts since the last sample.
+**/
+void perf_interval(uint64_t steps);
+
+/**
+ * Print the per-phase counts for a run to stderr and reset them.
+**/
+void perf_report(const char *engine, uint64_t steps);
+
+/**
+ * Start writing the perf map, and a jitdump if `jitdump` is set. Returns 0 if
+ * everything asked for could be created or -1.
+**/
+int perf_map_open(int jitdump);
+
+/**
+ * Name `size` bytes of native code at `code`, which are about to run. The
+ * jitdump has a timestamp on each, the perf map doesn't, so code replacing
+ * something at the same address after a flush may get either name there.
+ * No-op unless perf_map_open was called.
+**/
+void perf_map_code(const void *code, size_t size, const char *name);
+
+/**
+ * Flush and close both files.
+**/
+void perf_map_close(void);
+
+#define PERF_CHECK(steps) do { \
+    if((steps) >= perf_next) perf_interval(steps); \
+} while(0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
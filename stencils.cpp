@@ -0,0 +1,200 @@
+/**
+ * Stencils for the copy-and-patch backend (--engine=cnp, see cnp.cpp). Each
+ * instruction is a function written like its case in the interpreter, and the
+ * Makefile compiles this file on its own with flags that keep every function in
+ * its own section and every constant that depends on the instruction as a
+ * relocation against one of the _JIT_ symbols below. stencils.py then turns
+ * the object file into build/stencils.h: the bytes of each function and where
+ * each hole is, which cnp.cpp copies one after the other and fills in.
+ *
+ * A stencil carries on by tail calling _JIT_NEXT, which becomes a jmp to the
+ * stencil after it (or gets dropped when it's the last instruction), and leaves
+ * the trace by returning. Other traces are tail called the same way, through
+ * the tables in s. Everything is reached through s, so nothing but the holes
+ * needs relocating. Nothing makes GCC turn those into jmps though, and a call
+ * would grow the stack on every jump from one trace to the next, so
+ * stencils.py refuses any indirect call but the ones into the runtime.
+ *
+ * steps is what it was at the start of the instruction, so a fault leaves with
+ * the instruction not counted and the interpreter runs it again.
+**/
+#include <cstddef>
+#include <cstdint>
+
+#include "um.h"
+#include "jit.h"
+
+extern "C" {
+
+// Offsets of the registers in JitState
+extern char _JIT_A[], _JIT_B[], _JIT_C[];
+// pc of the instruction, its immediate, the whole word, a prg 0's target
+extern char _JIT_PC[], _JIT_IMM[], _JIT_WORD[], _JIT_TARGET[];
+// Offset of a prg 0's inline cache in s->ics
+extern char _JIT_SITE[];
+// The stencil after this one
+JitExit _JIT_NEXT(JitState *s, uint64_t steps);
+
+}
+
+#define HOLE(name) ((reg_t)(uintptr_t)_JIT_ ## name)
+#define REG(name) (*(reg_t *)((char *)s + (uintptr_t)_JIT_ ## name))
+
+#define NEXT() return _JIT_NEXT(s, steps + 1)
+#define LEAVE(to, counted, exit) do { \
+    s->pc = to; \
+    s->steps = steps + counted; \
+    return exit; \
+} while(0)
+#define FAIL() LEAVE(HOLE(PC), 0, JIT_INTERP)
+
+#define STENCIL(name) \
+    extern "C" JitExit stencil_ ## name(JitState *s, uint64_t steps)
+
+// Where in s the runtime is, the only pointers stencils.py lets them call
+extern "C" const uint32_t stencil_runtime[] = {
+    offsetof(JitState, new_array), offsetof(JitState, del_array),
+    offsetof(JitState, store_code), offsetof(JitState, out),
+    offsetof(JitState, out_string), offsetof(JitState, inp),
+    offsetof(JitState, event_at),
+};
+
+// What a trace is, as far as the stencil before it is concerned
+typedef JitExit (*Trace)(JitState *s, uint64_t steps);
+
+/**
+ * Go to the trace for to through the site's inline cache, filling it from
+ * s->entries on a miss. steps already counts the prg.
+**/
+[[gnu::always_inline]] inline JitExit dispatch(
+    JitState *s, uint64_t steps, reg_t to
+) {
+    // Past the end is never in a cache, even the 0xffffffff of a fresh one
+    if(to >= s->nentries) LEAVE(to, 0, JIT_JUMP);
+    JitIc &ic = *(JitIc *)((char *)s->ics + (uintptr_t)_JIT_SITE);
+    if(ic.pc[0] == to) return ((Trace)ic.code[0])(s, steps);
+    if(ic.pc[1] == to) return ((Trace)ic.code[1])(s, steps);
+
+    void *code = s->entries[to];
+    if(!code) LEAVE(to, 0, JIT_JUMP);
+    ic.pc[1] = ic.pc[0];
+    ic.code[1] = ic.code[0];
+    ic.pc[0] = to;
+    ic.code[0] = code;
+    return ((Trace)code)(s, steps);
+}
+
+// The JitCode every trace is called through
+extern "C" JitExit stencil_trampoline(JitState *s, void *trace) {
+    return ((Trace)trace)(s, s->steps);
+}
+
+STENCIL(mov) {
+    if(REG(C)) REG(A) = REG(B);
+    NEXT();
+}
+
+STENCIL(lda) {
+    reg_t b = REG(B), c = REG(C);
+    if(b >= s->narrays) FAIL();
+    const JitArray &array = s->arrays[b];
+    if(array.data == nullptr || c >= array.size) FAIL();
+    REG(A) = array.data[c];
+    NEXT();
+}
+
+STENCIL(sta) {
+    reg_t a = REG(A), b = REG(B);
+    if(a == 0) {
+        int result = s->store_code(s, b, REG(C));
+        if(result == 1) FAIL();
+        if(result == 2) LEAVE(HOLE(PC) + 1, 1, JIT_INTERP);
+        NEXT();
+    }
+    if(a >= s->narrays) FAIL();
+    const JitArray &array = s->arrays[a];
+    if(array.data == nullptr || b >= array.size) FAIL();
+    array.data[b] = REG(C);
+    NEXT();
+}
+
+STENCIL(add) {
+    REG(A) = REG(B) + REG(C);
+    NEXT();
+}
+
+STENCIL(mul) {
+    REG(A) = REG(B) * REG(C);
+    NEXT();
+}
+
+STENCIL(div) {
+    reg_t c = REG(C);
+    if(c == 0) FAIL();
+    REG(A) = REG(B) / c;
+    NEXT();
+}
+
+STENCIL(nan) {
+    REG(A) = ~(REG(B) & REG(C));
+    NEXT();
+}
+
+STENCIL(new) {
+    reg_t ident = s->new_array(s, REG(C));
+    REG(B) = ident;
+    NEXT();
+}
+
+STENCIL(del) {
+    reg_t c = REG(C);
+    if(c == 0) FAIL();
+    s->del_array(s, c);
+    NEXT();
+}
+
+STENCIL(out) {
+    reg_t c = REG(C);
+    if(c > 0xff) FAIL();
+    s->out(c);
+    NEXT();
+}
+
+STENCIL(inp) {
+    s->steps = steps + 1;
+    reg_t c = s->inp(s);
+    REG(C) = c;
+    NEXT();
+}
+
+STENCIL(ldi) {
+    REG(A) = HOLE(IMM);
+    NEXT();
+}
+
+// prg 0 in the middle of a trace, or the one that loops
+STENCIL(prg) {
+    if(REG(B)) FAIL();
+    if(steps + 1 >= s->event) {
+        s->steps = steps + 1;
+        s->event_at(s, HOLE(PC) + 1, HOLE(WORD));
+    }
+    reg_t c = REG(C);
+    if(c != HOLE(TARGET)) return dispatch(s, steps + 1, c);
+    NEXT();
+}
+
+// prg 0 that ends a trace, wherever it goes
+STENCIL(prg_exit) {
+    if(REG(B)) FAIL();
+    if(steps + 1 >= s->event) {
+        s->steps = steps + 1;
+        s->event_at(s, HOLE(PC) + 1, HOLE(WORD));
+    }
+    return dispatch(s, steps + 1, REG(C));
+}
+
+// End of a trace that doesn't end in a prg, PC is where to carry on
+STENCIL(exit) {
+    LEAVE(HOLE(PC), 0, JIT_INTERP);
+}
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+Turns the object file compiled from stencils.cpp into build/stencils.h for
+cnp.cpp, the Makefile runs it.
+
+Every .text.stencil_NAME section becomes an array of its bytes and a list of
+holes, the relocations against _JIT_ symbols: 32-bit absolute ones (register
+offsets and instruction fields) and the 32-bit relative operand of the jmp to
+_JIT_NEXT. Anything else in a stencil, a call through the PLT or a jump table
+in .rodata say, means it can't be copied on its own and is an error. So is an
+indirect call through anything but the runtime pointers in JitState listed in
+stencil_runtime: going to another trace has to be a jmp, or every jump between
+traces would leave a return address on the stack.
+
+Only reads what's needed of 64-bit little-endian ELF, which is the only thing
+the stencils are compiled for.
+"""
+
+import struct
+import sys
+
+R_X86_64_PC32, R_X86_64_PLT32 = 2, 4
+R_X86_64_32, R_X86_64_32S = 10, 11
+
+HOLES = ["A", "B", "C", "PC", "IMM", "WORD", "TARGET", "SITE", "NEXT"]
+
+def read_elf(path: str):
+    """Sections as name -> (header fields, bytes), and the symbol table as
+    (name, section name, value, size)."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != b"\x7fELF" or data[4] != 2 or data[5] != 1:
+        raise ValueError(f"{path} isn't a 64-bit little-endian ELF file")
+
+    shoff, = struct.unpack_from("<Q", data, 0x28)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x3a)
+    headers = [
+        struct.unpack_from("<IIQQQQIIQQ", data, shoff + i * shentsize)
+        for i in range(shnum)
+    ]
+
+    def string(table: int, offset: int):
+        start = headers[table][4] + offset
+        return data[start:data.index(b"\0", start)].decode()
+
+    names = [string(shstrndx, header[0]) for header in headers]
+    sections = {}
+    symbols = []
+    for name, header in zip(names, headers):
+        body = data[header[4]:header[4] + header[5]]
+        sections[name] = (header, body)
+        if header[1] == 2: # SHT_SYMTAB
+            for j in range(0, len(body), 24):
+                st_name, _, _, shndx, value, size = struct.unpack_from(
+                    "<IBBHQQ", body, j
+                )
+                section = names[shndx] if shndx < len(names) else None
+                symbols.append((string(header[6], st_name), section, value, size))
+    return sections, symbols
+
+def runtime(sections: dict, symbols: list):
+    """Offsets in stencil_runtime."""
+    for name, section, value, size in symbols:
+        if name == "stencil_runtime":
+            body = sections[section][1][value:value + size]
+            return set(struct.unpack(f"<{size // 4}I", body))
+    raise ValueError("no stencil_runtime")
+
+def indirect_calls(code: bytes):
+    """
+    Offset and displacement of everything in code that looks like an indirect
+    call (ff /2), the displacement None for a call through a register. Not
+    a disassembler, so an ff in some operand can turn up too, but then it's
+    only an error that wasn't needed.
+    """
+    for i in range(len(code) - 1):
+        modrm = code[i + 1]
+        if code[i] != 0xff or (modrm >> 3) & 7 != 2:
+            continue
+        mod, rm = modrm >> 6, modrm & 7
+        at = i + 2 + (rm == 4) # Past the SIB byte if there is one
+        if mod == 3:
+            yield i, None
+        elif mod == 1:
+            yield i, struct.unpack_from("<b", code, at)[0]
+        elif mod == 2:
+            yield i, struct.unpack_from("<i", code, at)[0]
+        else:
+            yield i, 0 if rm != 5 else None
+
+def stencils(path: str):
+    """(name, code, holes) of every stencil, holes as (offset, kind, hole,
+    addend)."""
+    sections, symbols = read_elf(path)
+    allowed = runtime(sections, symbols)
+    for section, (_, code) in sections.items():
+        if not section.startswith(".text.stencil_"):
+            continue
+        name = section[len(".text.stencil_"):]
+        for offset, disp in indirect_calls(code):
+            if disp not in allowed:
+                raise ValueError(
+                    f"stencil {name} has an indirect call at {offset:#x} that "
+                    "isn't into the runtime, another trace has to be a jmp"
+                )
+        holes = []
+        rela = sections.get(".rela" + section)
+        for j in range(0, len(rela[1]) if rela else 0, 24):
+            offset, info, addend = struct.unpack_from("<QQq", rela[1], j)
+            symbol, kind = symbols[info >> 32][0], info & 0xffffffff
+            hole = symbol[len("_JIT_"):]
+            if not symbol.startswith("_JIT_") or hole not in HOLES:
+                raise ValueError(f"stencil {name} refers to {symbol}")
+            if kind in (R_X86_64_32, R_X86_64_32S):
+                holes.append((offset, "ABS32", hole, addend))
+            elif kind in (R_X86_64_PC32, R_X86_64_PLT32):
+                # cnp.cpp patches these as the operand of a tail jmp
+                if hole == "NEXT" and (offset == 0 or code[offset - 1] != 0xe9):
+                    raise ValueError(
+                        f"stencil {name} reaches _JIT_NEXT without a jmp"
+                    )
+                holes.append((offset, "REL32", hole, addend))
+            else:
+                raise ValueError(f"stencil {name} has relocation type {kind}")
+        yield name, code, sorted(holes)
+
+def generate(path: str):
+    out = [
+        "// Generated by stencils.py from stencils.cpp, do not edit",
+        "",
+    ]
+    names = []
+    for name, code, holes in sorted(stencils(path)):
+        names.append((name, bool(holes)))
+        out.append(f"const uint8_t {name}_code[] = {{")
+        for i in range(0, len(code), 12):
+            out.append("    " + " ".join(f"0x{b:02x}," for b in code[i:i + 12]))
+        out.append("};")
+        if holes:
+            out.append(f"const Hole {name}_holes[] = {{")
+            for offset, kind, hole, addend in holes:
+                out.append(f"    {{{offset}, {kind}, HOLE_{hole}, {addend}}},")
+            out.append("};")
+        out.append("")
+
+    for name, holes in names:
+        out.append(f"const Stencil STENCIL_{name.upper()} = {{")
+        out.append(f"    {name}_code, sizeof({name}_code),")
+        if holes:
+            out.append(f"    {name}_holes, sizeof({name}_holes) / sizeof(Hole)")
+        else:
+            out.append("    nullptr, 0")
+        out.append("};")
+    return "\n".join(out) + "\n"
+
+def main(*argv):
+    if len(argv) != 3:
+        print(f"Usage: {argv[0]} <stencils.o> <output header>")
+        return 1
+    try:
+        text = generate(argv[1])
+    except ValueError as e:
+        print(e, file=sys.stderr)
+        return 1
+    with open(argv[2], "w") as f:
+        f.write(text)
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(*sys.argv))
@@ -0,0 +1,524 @@
+/**
+ * Variant of try.cpp which leans on the hardware for its safety checks instead
+ * of branching on every access. The README mentions an earlier attempt using
+ * `signal` which pessimized the hot loop; this one is structured so the
+ * handlers never need anything the optimizer has to keep in memory.
+ *
+ * - The array index is a single reservation big enough for every possible
+ *   32-bit identifier. Only the prefix that's actually in use is committed,
+ *   the rest is PROT_NONE, so an out-of-range identifier faults on the index
+ *   load itself rather than being compared against the index size.
+ * - Inactive arrays have size 0 (the free list lives in a tagged data pointer
+ *   instead of the size field like try.cpp) so the element bounds check also
+ *   covers the "is this array active" check. Faulting on the element index too
+ *   would need a 16 GB reservation per array, which runs out of address space
+ *   after ~8k arrays, so that one compare stays.
+ * - OP_DIV just divides and lets the CPU raise #DE (SIGFPE).
+ *
+ * -O3 keeps vm.pc in a register, and which one changes from build to build.
+ * So the few instructions which can trap are inline asm which also takes the
+ * UM pc and instruction count in esi and rdi. The handler reads them back out
+ * of the signal context, so nothing is stored on the way. It classifies the
+ * fault and siglongjmps back into interpret(). That and relying on #DE make
+ * this x86-64 only, like the JIT.
+**/
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <csignal>
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+
+//#define USE_COMPUTED 1
+
+#define REG(x) vm.registers[x]
+#define REG_I() REG((cur >> 25) & 7)
+#define RA() REG(RX(2, cur))
+#define RB() REG(RX(1, cur))
+#define RC() REG(RX(0, cur))
+#define IMM() (cur & 0x01ffffff) // Immediate value, 25 bits
+
+namespace {
+
+template<typename T>
+struct Array {
+    reg_t size; // Size of the array
+    T *data; // Pointer to the data
+
+    Array(reg_t initial_size = 0, T *initial_data = nullptr)
+        : size(initial_size), data(initial_data) {
+        if(initial_size && initial_data == nullptr) {
+            data = (T *)std::calloc(initial_size, sizeof(T));
+        }
+    }
+
+    T &operator[](reg_t index) {
+        return data[index];
+    }
+
+    void copy(const Array<T> &other) {
+        size = other.size;
+        data = (T *)std::realloc(data, size * sizeof(T));
+        std::memcpy(data, other.data, size * sizeof(T));
+    }
+
+    void free() {
+        std::free(data);
+        size = 0;
+        data = nullptr;
+    }
+};
+
+/**
+ * Index of every possible array identifier. The reservation is never moved so
+ * the handler can tell an index fault apart from a genuine crash by address.
+**/
+struct Index {
+    reg_t size; // Committed identifiers
+    Array<reg_t> *data;
+
+    static constexpr size_t RESERVE = (size_t(1) << 32) * sizeof(Array<reg_t>);
+
+    bool reserve(reg_t initial_size) {
+        void *base = mmap(
+            nullptr, RESERVE, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+        );
+        if(base == MAP_FAILED) return false;
+
+        size = 0;
+        data = (Array<reg_t> *)base;
+        return resize(initial_size);
+    }
+
+    /**
+     * Commit up to new_size identifiers. Anything committed past `size` by the
+     * page rounding reads as an inactive array.
+    **/
+    bool resize(reg_t new_size) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t bytes = (new_size * sizeof(Array<reg_t>) + page - 1) & ~(page - 1);
+        if(mprotect(data, bytes, PROT_READ | PROT_WRITE)) return false;
+        size = new_size;
+        return true;
+    }
+
+    void release() {
+        munmap(data, RESERVE);
+        data = nullptr;
+        size = 0;
+    }
+
+    Array<reg_t> &operator[](reg_t index) {
+        return data[index];
+    }
+};
+
+/**
+ * State shared with the fault handler. trap_pc and trap_steps are the UM pc
+ * and instruction count of the instruction that faulted, trap_index is the
+ * reservation to match SIGSEGV addresses against and trap_arrays is how much
+ * of it is committed, so the index can be torn down after a trap.
+**/
+static sigjmp_buf trap_env;
+static volatile sig_atomic_t trap_signal;
+static volatile reg_t trap_pc;
+static volatile uint64_t trap_steps;
+static const Array<reg_t> *trap_index;
+static volatile reg_t trap_arrays;
+static Array<reg_t> trap_prog;
+
+// Every active array needs a non-null, untagged data pointer even when empty
+static reg_t empty_array[1];
+
+struct VM {
+    reg_t free;
+    Array<reg_t> prog; // Cached program array
+    Index arrays;
+
+    reg_t pc;
+    reg_t registers[8];
+
+    /**
+     * Inactive arrays keep size = 0 so the bounds check covers them. The free
+     * list link goes in the data pointer instead, tagged with the low bit so it
+     * can't be mistaken for a real (aligned) allocation.
+    **/
+    static bool is_active(const Array<reg_t> &array) {
+        return array.data && !((uintptr_t)array.data & 1);
+    }
+
+    void set_next(reg_t ident, reg_t dst) {
+        arrays[ident] = Array<reg_t>(0, (reg_t *)(((uintptr_t)dst << 1) | 1));
+    }
+
+    reg_t get_next(reg_t ident) {
+        return (reg_t)((uintptr_t)arrays[ident].data >> 1);
+    }
+
+    void push_free(reg_t ident) {
+        set_next(ident, free);
+        free = ident;
+    }
+
+    void release() {
+        for(reg_t i = 0; i < arrays.size; ++i) {
+            if(is_active(arrays[i]) && arrays[i].data != empty_array) {
+                std::free(arrays[i].data);
+            }
+        }
+        arrays.release();
+    }
+
+    /**
+     * Zero pages from the index read as inactive arrays but aren't linked into
+     * anything, so the freshly committed half is threaded onto the free list.
+    **/
+    reg_t pop_new() {
+        reg_t ident = free;
+        if(ident) {
+            free = get_next(ident);
+        }
+        else {
+            ident = arrays.size;
+            if(!arrays.resize(arrays.size * 2)) {
+                perror("Failed to grow array index");
+                std::abort();
+            }
+            for(reg_t i = ident + 1; i < arrays.size - 1; ++i) {
+                set_next(i, i + 1);
+            }
+            set_next(arrays.size - 1, 0);
+            free = ident + 1;
+            trap_arrays = arrays.size;
+        }
+        return ident;
+    }
+};
+
+void check_arrays(void *ctx) {
+    VM &vm = *(VM *)ctx;
+    for(reg_t i = 0; i < vm.arrays.size; ++i) {
+        if(VM::is_active(vm.arrays[i])) {
+            check_array(i, vm.arrays[i].data, vm.arrays[i].size);
+        }
+    }
+}
+
+static void on_trap(int sig, siginfo_t *info, void *context) {
+    bool ours = (sig == SIGFPE && info->si_code == FPE_INTDIV)
+        || (sig == SIGSEGV && trap_index
+            && (uintptr_t)info->si_addr - (uintptr_t)trap_index < Index::RESERVE);
+
+    if(!ours) {
+        // Genuine crash, let it happen again with the default disposition
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    // Where trap_load and trap_div left them
+    const greg_t *regs = ((ucontext_t *)context)->uc_mcontext.gregs;
+    trap_pc = (reg_t)regs[REG_RSI] - 1;
+    trap_steps = (uint64_t)regs[REG_RDI];
+    trap_signal = sig;
+    siglongjmp(trap_env, 1);
+}
+
+/**
+ * Load an entry of the index, which faults if it's past the committed part,
+ * with the pc of the next instruction in esi and the count in rdi for on_trap.
+ * The asm is only there to pin those, it's the same two loads the compiler
+ * would do.
+**/
+static inline Array<reg_t> trap_load(
+    const Array<reg_t> *entry, reg_t pc, uint64_t steps
+) {
+    Array<reg_t> array;
+    asm volatile(
+        "movl %c[size](%[entry]), %[s]\n\t"
+        "movq %c[data](%[entry]), %[d]"
+        : [s] "=&r"(array.size), [d] "=r"(array.data)
+        : [entry] "r"(entry), "m"(*entry), "S"(pc), "D"(steps),
+          [size] "i"(offsetof(Array<reg_t>, size)),
+          [data] "i"(offsetof(Array<reg_t>, data))
+    );
+    return array;
+}
+
+/**
+ * b / c, raising #DE if c is 0, with the pc and count pinned like trap_load.
+**/
+static inline reg_t trap_div(reg_t b, reg_t c, reg_t pc, uint64_t steps) {
+    reg_t rem = 0;
+    asm volatile(
+        "divl %[c]"
+        : "+a"(b), "+d"(rem)
+        : [c] "r"(c), "S"(pc), "D"(steps)
+    );
+    return b;
+}
+
+/**
+ * Saw this trick in the CPython interpreter years ago, seems to be more
+ *  complicated now but a simpler version can be found at
+ *  https://eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables
+ *
+ * Speed-up is primarily because branch prediction is per-address, meaning if
+ *  it's based on a single branch (eg the switch statement) the branch predictor
+ *  can't predict anything effectively.
+ *
+ * However, switch is still faster on unoptimized builds. Computed goto is a
+ *  couple seconds faster with -Ofast running sandmark.
+**/
+#if defined(USE_COMPUTED) && (defined(__GNUC__) || defined(__clang__))
+    #define DISPATCH_TABLE(...) void *dispatch_table[] = {__VA_ARGS__}
+    #define SWITCH(cur) goto *dispatch_table[OPCODE(cur)];
+    #define DISPATCH_GOTO() do { \
+        if(vm.pc >= vm.prog.size) FAIL(ERR_EOF); \
+        cur = vm.prog[vm.pc++]; \
+        ++steps; \
+        SWITCH(cur); \
+    } while(0)
+    #define TARGET(op) TARGET_ ## op
+#else
+    #define DISPATCH_TABLE(...)
+    #define DISPATCH_GOTO() continue
+    #define TARGET(op) case op
+    #define SWITCH(op) switch(OPCODE(op))
+#endif
+
+#define FAIL(err) do [[unlikely]] { error = err; goto finish; } while(0)
+
+/**
+ * Classify a fault caught by on_trap. Index faults are attributed to whatever
+ * instruction was at trap_pc. Only the program array is needed for
+ * that and it only changes in OP_PRG, so a copy is kept in trap_prog rather
+ * than letting the VM escape into memory.
+**/
+static Error trap_error() {
+    if(trap_signal == SIGFPE) return ERR_DIV;
+
+    reg_t pc = trap_pc;
+    if(pc < trap_prog.size && OPCODE(trap_prog[pc]) == OP_DEL) return ERR_DEL;
+    return ERR_ARR;
+}
+
+/**
+ * Work on a local copy of the VM to avoid indirection overhead, it's only
+ * written back at the end so the caller can tear it down. Return for debug.
+ *
+ * The instruction count is kept for I/O recording and reported through
+ * steps_out, it's a single register increment per dispatch. Deriving it from
+ * pc costs more than that here too (see try.cpp).
+**/
+Error interpret(VM &state, uint64_t *steps_out) {
+    VM vm = state;
+    Error error = ERR_OK;
+    uint64_t steps = 0;
+    DISPATCH_TABLE(
+        &&TARGET(OP_MOV),
+        &&TARGET(OP_LDA), &&TARGET(OP_STA),
+        &&TARGET(OP_ADD), &&TARGET(OP_MUL), &&TARGET(OP_DIV),
+        &&TARGET(OP_NAN), &&TARGET(OP_HLT),
+        &&TARGET(OP_NEW), &&TARGET(OP_DEL),
+        &&TARGET(OP_OUT), &&TARGET(OP_INP),
+        &&TARGET(OP_PRG), &&TARGET(OP_LDI),
+        &&TARGET(OP_x14), &&TARGET(OP_x15)
+    );
+
+    trap_signal = 0;
+    trap_index = vm.arrays.data;
+    trap_arrays = vm.arrays.size;
+    trap_prog = vm.prog;
+    if(sigsetjmp(trap_env, 1)) {
+        // Locals are indeterminate after the jump, only use what on_trap saved.
+        // The index is still fine to tear down since its reservation never
+        // moves, and it's only committed up to the size it was at when trapped.
+        trap_index = nullptr;
+        state.arrays.size = trap_arrays;
+        *steps_out = trap_steps;
+        return trap_error();
+    }
+
+    do {
+        reg_t cur = vm.prog[vm.pc++];
+        ++steps;
+        SWITCH(cur) {
+            TARGET(OP_MOV): {
+                RA() = RC()? RB() : RA();
+                DISPATCH_GOTO();
+            }
+
+            TARGET(OP_LDA): {
+                auto array = trap_load(&vm.arrays[RB()], vm.pc, steps);
+                reg_t c = RC();
+                if(c >= array.size) FAIL(ERR_ARR);
+
+                RA() = array[c];
+                DISPATCH_GOTO();
+            }
+
+            TARGET(OP_STA): {
+                auto array = trap_load(&vm.arrays[RA()], vm.pc, steps);
+                reg_t b = RB();
+                if(b >= array.size) FAIL(ERR_ARR);
+
+                array[b] = RC();
+                DISPATCH_GOTO();
+            }
+
+            TARGET(OP_ADD):
+                RA() = RB() + RC(); // Implicit mod
+                DISPATCH_GOTO();
+
+            TARGET(OP_MUL):
+                RA() = RB() * RC();
+                DISPATCH_GOTO();
+
+            TARGET(OP_DIV):
+                RA() = trap_div(RB(), RC(), vm.pc, steps); // #DE on zero
+                DISPATCH_GOTO();
+
+            TARGET(OP_NAN):
+                RA() = ~(RB() & RC());
+                DISPATCH_GOTO();
+
+            TARGET(OP_HLT):
+                goto finish;
+
+            TARGET(OP_NEW): {
+                reg_t ident = vm.pop_new();
+                reg_t size = RC();
+                vm.arrays[ident] = size?
+                    Array<reg_t>(size) : Array<reg_t>(0, empty_array);
+                RB() = ident;
+                DISPATCH_GOTO();
+            }
+
+            TARGET(OP_DEL): {
+                reg_t ident = RC();
+                if(ident == 0) FAIL(ERR_DEL); // Attempted to delete the program
+
+                if(!VM::is_active(trap_load(&vm.arrays[ident], vm.pc, steps))) {
+                    FAIL(ERR_DEL);
+                }
+
+                auto &array = vm.arrays[ident];
+                if(array.data != empty_array) array.free();
+                vm.push_free(ident);
+                DISPATCH_GOTO();
+            }
+
+            TARGET(OP_OUT): {
+                reg_t c = RC();
+                if(c > 0xff) FAIL(ERR_CHR); // Invalid character
+                output_putc(c);
+                DISPATCH_GOTO();
+            }
+
+            TARGET(OP_INP):
+                RC() = input_getc(steps); // -1 on EOF
+                DISPATCH_GOTO();
+
+            TARGET(OP_PRG): {
+                PERF_CHECK(steps);
+                CHECK_POINT(steps, vm.pc, cur, vm.registers, check_arrays, &vm);
+                // It's not explicitly stated but PRG 0 is a no-op aside from
+                // assigning the PC, so it's likely intended to double as an
+                // absolute jump.
+                if(reg_t ident = RB()) {
+                    auto origin = trap_load(&vm.arrays[ident], vm.pc, steps);
+                    if(!VM::is_active(origin)) FAIL(ERR_PRG);
+
+                    vm.prog.copy(origin);
+                    vm.arrays[0] = vm.prog;
+                    trap_prog = vm.prog;
+                }
+                vm.pc = RC();
+                DISPATCH_GOTO();
+            }
+
+            TARGET(OP_LDI):
+                REG_I() = IMM();
+                DISPATCH_GOTO();
+
+            TARGET(OP_x14):
+            TARGET(OP_x15):
+                FAIL(ERR_INV);
+        }
+
+        // Fall-through if using switch
+        FAIL(ERR_INV);
+    } while(vm.pc < vm.prog.size);
+
+    // Just in case
+    FAIL(ERR_EOF);
+
+    finish:
+        trap_index = nullptr;
+        state = vm;
+        *steps_out = steps;
+        return error;
+}
+
+}
+
+Error trap_run(const reg_t *code, reg_t size, uint64_t *steps) {
+    Array<reg_t> prog(size);
+    if(size) std::memcpy(prog.data, code, size * sizeof(reg_t));
+
+    VM vm;
+    vm.free = 1;
+    vm.prog = prog;
+    vm.pc = 0;
+    std::memset(vm.registers, 0, sizeof(vm.registers));
+
+    if(!vm.arrays.reserve(256)) {
+        perror("Failed to reserve array index");
+        std::abort();
+    }
+    vm.arrays[0] = prog;
+    for(reg_t i = 1; i < 255; ++i) {
+        vm.set_next(i, i + 1);
+    }
+    vm.set_next(255, 0);
+
+    struct sigaction sa, old_segv, old_fpe;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_trap;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &old_segv);
+    sigaction(SIGFPE, &sa, &old_fpe);
+
+    perf_phase(PERF_EXEC);
+    Error err = interpret(vm, steps);
+    perf_phase(PERF_TEARDOWN);
+
+    // After a trap only what on_trap saved is known
+    if(trap_signal) {
+        CHECK_DONE(*steps, err, trap_pc + 1, nullptr, nullptr, nullptr);
+    }
+    else {
+        CHECK_DONE(*steps, err, vm.pc, vm.registers, check_arrays, &vm);
+    }
+
+    sigaction(SIGSEGV, &old_segv, nullptr);
+    sigaction(SIGFPE, &old_fpe, nullptr);
+    vm.release();
+
+    if(err && trap_signal) {
+        fprintf(stderr, "Trapped at pc %u\n", trap_pc);
+    }
+    return err;
+}
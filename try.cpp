@@ -17,12 +17,13 @@
 #include <cstdlib>
 #include <cstring>
 
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+
 //#define USE_COMPUTED 1
 
-// XXXX .... .... .... .... ...A AABB BCCC (generic)
-// 1101 III. NNNN NNNN NNNN NNNN NNNN NNNN (ldi)
-#define OPCODE(n) ((n) >> 28)
-#define RX(n, x) (((x) >> ((n)*3)) & 7)
 #define REG(x) vm.registers[x]
 #define REG_I() REG((cur >> 25) & 7)
 #define RA() REG(RX(2, cur))
@@ -30,37 +31,7 @@
 #define RC() REG(RX(0, cur))
 #define IMM() (cur & 0x01ffffff) // Immediate value, 25 bits
 
-#define OP_MOV  0 // A <- B unless C = 0
-#define OP_LDA  1 // A <- B[C]
-#define OP_STA  2 // A[B] <- C
-#define OP_ADD  3 // A <- B + C mod 2^32
-#define OP_MUL  4 // A <- B * C mod 2^32
-#define OP_DIV  5 // A <- int(B / C)
-#define OP_NAN  6 // A <- ~(B & C)
-#define OP_HLT  7 // halt execution
-#define OP_NEW  8 // B <- new reg_t[C]
-#define OP_DEL  9 // delete C
-#define OP_OUT 10 // putc(C)
-#define OP_INP 11 // C <- getc(), -1 EOF
-#define OP_PRG 12 // prog <- copy(B); PC <- C
-#define OP_LDI 13 // A <- N
-
-#define OP_INVALID 14
-#define OP_x14  14
-#define OP_x15  15 // Defined for completion's sake
-
-typedef enum {
-    ERR_OK = 0,
-    ERR_INV, // Invalid instruction
-    ERR_ARR, // Inactive array identifier
-    ERR_DEL, // Deleted 0 or inactive array
-    ERR_DIV, // Division by zero
-    ERR_PRG, // Loaded program from inactive array
-    ERR_CHR, // Printed character outside of [0, 255]
-    ERR_EOF  // PC out of bounds
-} Error;
-
-typedef uint32_t reg_t;
+namespace {
 
 template<typename T>
 struct Array {
@@ -138,19 +109,19 @@ struct VM {
         }
         return ident;
     }
+
+    void release() {
+        for(reg_t i = 0; i < arrays.size; ++i) {
+            if(arrays[i].data) arrays[i].free();
+        }
+        arrays.free();
+    }
 };
 
-const char *errname(Error err) {
-    switch(err) {
-        case ERR_OK: return "OK";
-        case ERR_INV: return "INV";
-        case ERR_ARR: return "ARR";
-        case ERR_DEL: return "DEL";
-        case ERR_DIV: return "DIV";
-        case ERR_PRG: return "PRG";
-        case ERR_CHR: return "CHR";
-        case ERR_EOF: return "EOF";
-        default: return "Unknown error";
+void check_arrays(void *ctx) {
+    VM &vm = *(VM *)ctx;
+    for(reg_t i = 0; i < vm.arrays.size; ++i) {
+        if(vm.arrays[i].data) check_array(i, vm.arrays[i].data, vm.arrays[i].size);
     }
 }
 
@@ -172,6 +143,7 @@ const char *errname(Error err) {
     #define DISPATCH_GOTO() do { \
         if(vm.pc >= vm.prog.size) FAIL(ERR_EOF); \
         cur = vm.prog[vm.pc++]; \
+        ++steps; \
         SWITCH(cur); \
     } while(0)
     #define TARGET(op) TARGET_ ## op
@@ -185,10 +157,19 @@ const char *errname(Error err) {
 #define FAIL(err) do [[unlikely]] { error = err; goto finish; } while(0)
 
 /**
- * Pass VM by value to avoid indirection overhead. Return for debug.
+ * Work on a local copy of the VM to avoid indirection overhead, it's only
+ * written back at the end so the caller can tear it down. Return for debug.
+ *
+ * The instruction count is kept for I/O recording and reported through
+ * steps_out, it's a single register increment per dispatch. Working it out
+ * from pc instead, with a base that only moves on prg, was 6.6% slower on
+ * sandmark.um: the increment is off the critical path, and without it GCC
+ * splits the one dispatch tail every handler shares into four.
 **/
-Error interpret(VM vm) {
+Error interpret(VM &state, uint64_t *steps_out) {
+    VM vm = state;
     Error error = ERR_OK;
+    uint64_t steps = 0;
     DISPATCH_TABLE(
         &&TARGET(OP_MOV),
         &&TARGET(OP_LDA), &&TARGET(OP_STA),
@@ -202,6 +183,7 @@ Error interpret(VM vm) {
 
     do {
         reg_t cur = vm.prog[vm.pc++];
+        ++steps;
         //printop(cur);
         //printregs(&vm);
         SWITCH(cur) {
@@ -225,6 +207,9 @@ Error interpret(VM vm) {
                  * Not actually sure why REG(C? 1 : 2) is slower though.
                  * Functionally that looks like R[A] = R[R[C]? B : A] and the
                  * assembly shows it uses cmove and no branches...
+                 *
+                 * Times above are whole sandmark runs, re-time any new variant
+                 * with bench/mov-taken.uma and bench/mov-not-taken.uma.
                 **/
                 RA() = RC()? RB() : RA();
                 DISPATCH_GOTO();
@@ -293,17 +278,17 @@ Error interpret(VM vm) {
             TARGET(OP_OUT): {
                 reg_t c = RC();
                 if(c > 0xff) FAIL(ERR_CHR); // Invalid character
-                putchar(c);
+                output_putc(c);
                 DISPATCH_GOTO();
             }
 
-            TARGET(OP_INP): {
-                int c = getchar();
-                RC() = (c == EOF? -1 : c);
+            TARGET(OP_INP):
+                RC() = input_getc(steps); // -1 on EOF
                 DISPATCH_GOTO();
-            }
 
             TARGET(OP_PRG): {
+                PERF_CHECK(steps);
+                CHECK_POINT(steps, vm.pc, cur, vm.registers, check_arrays, &vm);
                 // It's not explicitly stated but PRG 0 is a no-op aside from
                 // assigning the PC, so it's likely intended to double as an
                 // absolute jump.
@@ -337,36 +322,17 @@ Error interpret(VM vm) {
     FAIL(ERR_EOF);
 
     finish:
+        CHECK_DONE(steps, error, vm.pc, vm.registers, check_arrays, &vm);
+        state = vm;
+        *steps_out = steps;
         return error;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc < 2) {
-        fprintf(stderr, "Usage: %s <program>\n", argv[0]);
-        return 0;
-    }
-
-    FILE *fp = fopen(argv[1], "rb");
-    if(!fp) {
-        perror("Failed to open program file");
-        return -1;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+}
 
+Error try_run(const reg_t *code, reg_t size, uint64_t *steps) {
     Array<reg_t> prog(size);
-
-    for(size_t i = 0; i < size / sizeof(reg_t); ++i) {
-        uint8_t buf[4];
-        if(fread(buf, 1, 4, fp) < 4) {
-            break;
-        }
-        prog[i] = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
-    }
-
-    fclose(fp);
+    if(size) std::memcpy(prog.data, code, size * sizeof(reg_t));
 
     Array<Array<reg_t>> arrays(256);
     arrays[0] = prog;
@@ -379,9 +345,9 @@ int main(int argc, char *argv[]) {
         .registers = {0}
     };
     vm.set_next(255, 0);
-    Error err = interpret(vm);
-    if(err) {
-        fprintf(stderr, "ERR_%s\n", errname(err));
-    }
+    perf_phase(PERF_EXEC);
+    Error err = interpret(vm, steps);
+    perf_phase(PERF_TEARDOWN);
+    vm.release();
     return err;
 }
@@ -22,10 +22,11 @@
 #include <bit>
 #include <algorithm>
 
-// XXXX .... .... .... .... ...A AABB BCCC (generic)
-// 1101 III. NNNN NNNN NNNN NNNN NNNN NNNN (ldi)
-#define OPCODE(n) ((n) >> 28)
-#define RX(n, x) (((x) >> ((n)*3)) & 7)
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+
 #define REG(x) registers[x]
 #define REG_I() REG((cur >> 25) & 7)
 #define RA() REG(RX(2, cur))
@@ -33,37 +34,9 @@
 #define RC() REG(RX(0, cur))
 #define IMM() (cur & 0x01ff'ffff) // Immediate value, 25 bits
 
-#define OP_MOV  0 // A <- B unless C = 0
-#define OP_LDA  1 // A <- B[C]
-#define OP_STA  2 // A[B] <- C
-#define OP_ADD  3 // A <- B + C
-#define OP_MUL  4 // A <- B * C
-#define OP_DIV  5 // A <- int(B / C)
-#define OP_NAN  6 // A <- ~(B & C)
-#define OP_HLT  7 // halt execution
-#define OP_NEW  8 // B <- new reg_t[C]
-#define OP_DEL  9 // delete C
-#define OP_OUT 10 // putc(C)
-#define OP_INP 11 // C <- getc(), -1 EOF
-#define OP_PRG 12 // prog <- copy(B); PC <- C
-#define OP_LDI 13 // A <- N
-
-#define OP_INVALID 14
-#define OP_x14  14
-#define OP_x15  15 // Defined for completion's sake
-
-enum Error {
-    ERR_OK = 0,
-    ERR_INV, // Invalid instruction
-    ERR_ARR, // Inactive array identifier
-    ERR_DEL, // Deleted 0 or inactive array
-    ERR_DIV, // Division by zero
-    ERR_PRG, // Loaded program from inactive array
-    ERR_CHR, // Printed character outside of [0, 255]
-    ERR_EOF  // PC out of bounds
-};
+typedef reg_t word_t;
 
-typedef uint32_t word_t;
+namespace {
 
 /**
  * Saw this trick in the CPython interpreter years ago, seems to be more
@@ -83,6 +56,7 @@ typedef uint32_t word_t;
     #define DISPATCH_GOTO() do { \
         if(pc >= prog.size) FAIL(ERR_EOF); \
         cur = prog[pc++]; \
+        ++steps; \
         SWITCH(cur); \
     } while(0)
     #define TARGET(op) TARGET_ ## op
@@ -101,48 +75,66 @@ typedef uint32_t word_t;
  * Inspired loosely by tcmalloc but dramatically simplified and without any
  * kind of thread safety.
  *
- * We split allocations into small and large objects around 4 kB. Small
- * objects are split into size classes of powers-of-two, each with its own
- * free list. New arenas are allocated in pages.
- *
- * Large objects are allocated using ordinary malloc.
+ * We split allocations into small and large objects around 256 bytes. Small
+ * objects are split into size classes of powers-of-two words, each with its
+ * own free list of pages which still have a free slot. Large objects get their
+ * own run of pages from aligned_alloc.
 **/
 //*
 
 #define LGOB 0xffff // Marker for large object
 #define PAGE 4096
+#define NCLASSES 7 // 1 to 64 words
+#define MAXSLOTS 512 // Bits in Page::bitmap
 
-#define SZ(x) (2u << (x)) // Convert size class to max size in bytes
+#define SZ(x) (1u << (x)) // Convert size class to max size in words
 
 /**
  * Small object allocations are organized as divisions in a page. This allows
  * the derivation of the page (and its metadata) from an address within it.
 **/
 struct Page {
-    // Large objects can never be in a freelist so we can store the size here{
-    Page *next; // May be garbage if not in a freelist
+    union {
+        Page *next; // May be garbage if not in a freelist
+        word_t lgob_size; // Large objects can never be in a freelist
+    };
 
     uint16_t nslots; // How many slots are in this size class
     uint16_t used; // How many slots are currently used
 
     uint16_t szclass;
     uint16_t fullmask; // Which bitmaps are full (contain no free slots)
-    uint64_t bitmap[8];
+    uint64_t bitmap[8]; // Set bits are used slots
 
     uint32_t data[];
 
     Page(uint32_t sz) {
         next = nullptr;
         szclass = sz;
-        nslots = SZ(sz)? (PAGE - offsetof(Page, data))/SZ(sz) : 0;
         used = 0;
         fullmask = 0;
         std::memset(bitmap, 0, sizeof(bitmap));
+
+        if(sz == LGOB) {
+            nslots = 0;
+            return;
+        }
+
+        word_t slots = (PAGE - offsetof(Page, data)) / (SZ(sz) * sizeof(word_t));
+        nslots = std::min(slots, (word_t)MAXSLOTS);
+
+        // Slots past the end of the page are permanently "used"
+        for(word_t slot = nslots; slot < MAXSLOTS; ++slot) {
+            bitmap[slot / 64] |= 1ull << (slot % 64);
+        }
+        for(word_t bmx = 0; bmx < 8; ++bmx) {
+            fullmask |= (bitmap[bmx] == UINT64_MAX) << bmx;
+        }
     }
 
     void set_free(word_t slot) {
         word_t bmx = slot / 64;
-        bitmap[bmx] |= (1 << (slot % 64));
+        bitmap[bmx] &= ~(1ull << (slot % 64));
         // If something was freed, that block can't be full
         fullmask &= ~(1 << bmx);
         --used;
@@ -150,20 +142,27 @@ struct Page {
 
     void set_used(word_t slot) {
         word_t bmx = slot / 64;
-        bitmap[bmx] &= ~(1 << (slot % 64));
+        bitmap[bmx] |= 1ull << (slot % 64);
         fullmask |= ((bitmap[bmx] == UINT64_MAX) << bmx);
         ++used;
     }
 
     word_t *pop_free() {
-        word_t bmx = std::__countr_one(fullmask);
+        word_t bmx = std::countr_one(fullmask);
         assert(bmx < 8); // Must have at least one free slot
-        word_t sub = std::__countr_one(bitmap[bmx]);
+        word_t sub = std::countr_one(bitmap[bmx]);
         assert(sub < 64); // Must have at least one free slot
         word_t slot = (bmx * 64) | sub;
         assert(slot < nslots);
         set_used(slot);
-        return &data[slot * SZ(szclass) / sizeof(word_t)];
+        return &data[slot * SZ(szclass)];
+    }
+
+    /**
+     * How many words an allocation in this page can hold.
+    **/
+    word_t capacity() {
+        return szclass == LGOB? lgob_size : SZ(szclass);
     }
 
     bool is_empty() {
@@ -177,26 +176,23 @@ struct Page {
 
 // Size classes of small objects - these form a linked list of pages. Every
 // entry in this list has at least one free slot.
-static Page *free_smob[13] = {0};
+static Page *free_smob[NCLASSES] = {0};
 
 Page *tlc_page(void *ptr) {
-    return (Page *)((uintptr_t)ptr & ~(PAGE - 1));
+    return (Page *)((uintptr_t)ptr & ~(uintptr_t)(PAGE - 1));
 }
 
 word_t *tlcmalloc(word_t words) {
-    if(words <= 256/sizeof(word_t)) {
-        printf("tlcmalloc smob\n");
-        // Saturate sizes 0-2 to szclass 0, otherwise do powers of two
-        word_t szclass = 32 - std::__countl_zero(
-            std::max(words - 1, 0u) >> 1
-        );
+    if(words <= SZ(NCLASSES - 1)) {
+        // Round up to the next power of two words
+        word_t szclass = words <= 1? 0 : 32 - std::countl_zero(words - 1);
         Page *page = free_smob[szclass];
         if(page == nullptr) {
             // Out of pages, make a new one
             page = (Page *)std::aligned_alloc(PAGE, PAGE);
             assert(page != nullptr);
             new (page) Page(szclass);
-            printf("New page %d %p\n", szclass, page);
+            free_smob[szclass] = page;
         }
 
         word_t *obj = page->pop_free();
@@ -207,10 +203,9 @@ word_t *tlcmalloc(word_t words) {
         return obj;
     }
     else {
-        printf("tlcmalloc lgob\n");
-        // Allocate large objects using malloc
-        word_t paged = (words + offsetof(Page, data) + PAGE - 1) / PAGE * PAGE;
-        printf("lgob size %d -> %d\n", words, paged);
+        // Allocate large objects as their own run of pages
+        size_t bytes = offsetof(Page, data) + (size_t)words * sizeof(word_t);
+        size_t paged = (bytes + PAGE - 1) / PAGE * PAGE;
         Page *page = (Page *)std::aligned_alloc(PAGE, paged);
         assert(page != nullptr);
         new (page) Page(LGOB);
@@ -234,37 +229,28 @@ void tlcfree(word_t *ptr) {
     word_t szclass = page->szclass;
     word_t index = (ptr - page->data) / SZ(szclass);
 
-    // If the page was full, add it back to the freelist
-    // If the page is empty and there are other pages, free this page
-    // Otherwise it's already in the freelist
+    bool was_full = page->is_full();
+    page->set_free(index);
 
-    if(page->is_full()) {
+    if(was_full) {
+        // Has a free slot again, add it back to the freelist
         page->next = free_smob[szclass];
         free_smob[szclass] = page;
     }
     else if(page->is_empty()) {
-        // Search for the page in the freelist
-        word_t npages = 0;
+        // Free the page unless it's the only one, we'll need it later anyway
         Page **indirect = &free_smob[szclass];
-        while(*indirect && *indirect != page) {
-            ++npages;
+        if(*indirect == page && page->next == nullptr) return;
+
+        while(*indirect != page) {
             indirect = &(*indirect)->next;
         }
-        if(npages > 0) {
-            // Found it, remove from the freelist
-            *indirect = page->next;
-            std::free(page);
-            return; // Avoid set_free because page was freed
-        }
-        else {
-            // Only page, leave it in the freelist because we'll need it
-            // later anyway
-        }
+        *indirect = page->next;
+        std::free(page);
     }
     else {
         // Already in the freelist and nothing to do
     }
-    page->set_free(index);
 }
 //*/
 
@@ -276,7 +262,6 @@ struct ArrayPtr {
         : size(initial_size), data(initial_data) {
         if(initial_size && initial_data == nullptr) {
             data = tlcmalloc(initial_size);
-            printf("memset (%p) %d\n", data, initial_size);
             std::memset(data, 0, initial_size * sizeof(word_t));
         }
     }
@@ -286,9 +271,7 @@ struct ArrayPtr {
     }
 
     void copy(const ArrayPtr &other) {
-        Page *page = tlc_page(data);
-        word_t szclass = page->szclass;
-        if(szclass == LGOB || SZ(szclass)/sizeof(word_t) < other.size) {
+        if(data == nullptr || tlc_page(data)->capacity() < other.size) {
             // Need to grow the memory to fit
             tlcfree(data);
             data = tlcmalloc(other.size);
@@ -304,20 +287,6 @@ struct ArrayPtr {
     }
 };
 
-const char *errname(Error err) {
-    switch(err) {
-        case ERR_OK: return "OK";
-        case ERR_INV: return "INV";
-        case ERR_ARR: return "ARR";
-        case ERR_DEL: return "DEL";
-        case ERR_DIV: return "DIV";
-        case ERR_PRG: return "PRG";
-        case ERR_CHR: return "CHR";
-        case ERR_EOF: return "EOF";
-        default: return "Unknown error";
-    }
-}
-
 /**
  * The array index grows and while realloc is possible with tlcmalloc, it's
  * more geared toward realloc for *smaller* sizes (eg the program array).
@@ -361,14 +330,16 @@ struct VM {
         }
 
         // Free any of the remaining pages
-        for(word_t i = 0; i < 13; i++) {
+        for(word_t i = 0; i < NCLASSES; i++) {
             Page *it = free_smob[i];
             while(it) {
-                Page *tmp = it->next;
+                Page *tmp = it;
                 it = it->next;
                 std::free(tmp);
             }
+            free_smob[i] = nullptr;
         }
+        std::free(arrays.data);
     }
 
     /**
@@ -404,8 +375,17 @@ struct VM {
         return ident;
     }
 
-    Error interpret() {
+    static void check_arrays(void *ctx) {
+        VM &vm = *(VM *)ctx;
+        for(word_t i = 0; i < vm.arrays.size; ++i) {
+            auto &array = vm.arrays[i];
+            if(array.data) check_array(i, array.data, array.size);
+        }
+    }
+
+    Error interpret(uint64_t *steps_out) {
         Error error = ERR_OK;
+        uint64_t steps = 0;
         DISPATCH_TABLE(
             &&TARGET(OP_MOV),
             &&TARGET(OP_LDA), &&TARGET(OP_STA),
@@ -419,6 +399,7 @@ struct VM {
 
         do {
             word_t cur = prog[pc++];
+            ++steps;
             //printop(cur);
             //printregs(&vm);
             SWITCH(cur) {
@@ -511,17 +492,17 @@ struct VM {
                 TARGET(OP_OUT): {
                     word_t c = RC();
                     if(c > 0xff) FAIL(ERR_CHR); // Invalid character
-                    putchar(c);
+                    output_putc(c);
                     DISPATCH_GOTO();
                 }
 
-                TARGET(OP_INP): {
-                    int c = getchar();
-                    RC() = (c == EOF? -1 : c);
+                TARGET(OP_INP):
+                    RC() = input_getc(steps); // -1 on EOF
                     DISPATCH_GOTO();
-                }
 
                 TARGET(OP_PRG): {
+                    PERF_CHECK(steps);
+                    CHECK_POINT(steps, pc, cur, registers, check_arrays, this);
                     // It's not explicitly stated but PRG 0 is a no-op aside from
                     // assigning the PC, so it's likely intended to double as an
                     // absolute jump.
@@ -556,37 +537,17 @@ struct VM {
         FAIL(ERR_EOF);
 
         finish:
+            CHECK_DONE(steps, error, pc, registers, check_arrays, this);
+            *steps_out = steps;
             return error;
     }
 };
 
-int main(int argc, char *argv[]) {
-    if(argc < 2) {
-        fprintf(stderr, "Usage: %s <program>\n", argv[0]);
-        return 0;
-    }
-
-    FILE *fp = fopen(argv[1], "rb");
-    if(!fp) {
-        perror("Failed to open program file");
-        return -1;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    ArrayPtr prog(size/sizeof(word_t));
-
-    for(size_t i = 0; i < size / sizeof(word_t); ++i) {
-        uint8_t buf[4];
-        if(fread(buf, 1, 4, fp) < 4) {
-            break;
-        }
-        prog[i] = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
-    }
+}
 
-    fclose(fp);
+Error try4_run(const reg_t *code, reg_t size, uint64_t *steps) {
+    ArrayPtr prog(size);
+    if(size) std::memcpy(prog.data, code, size * sizeof(word_t));
 
     ArrayIndex arrays;
     arrays[0] = prog;
@@ -599,9 +560,8 @@ int main(int argc, char *argv[]) {
         .registers = {0}
     };
     vm.set_next(255, 0);
-    Error err = vm.interpret();
-    if(err) {
-        fprintf(stderr, "ERR_%s\n", errname(err));
-    }
+    perf_phase(PERF_EXEC);
+    Error err = vm.interpret(steps);
+    perf_phase(PERF_TEARDOWN);
     return err;
 }
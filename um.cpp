@@ -0,0 +1,325 @@
+/**
+ * Driver for every engine. The program is loaded once and handed to each
+ * engine picked with --engine, so they can be compared against each other in
+ * the same process on the same input (scripted and replayed input is rewound
+ * between runs).
+ *
+ * With more than one engine (or --stats) a summary line per run goes to
+ * stderr, bench.py parses it. --perf adds hardware counters per phase of each
+ * run, and --perf-interval N also every N UM instructions.
+ *
+ * --check=NAME runs NAME against the default engine in lockstep instead (see
+ * check.h) and reports the first point where their states differ.
+ *
+ * --aot-profile DIR makes the aot engine interpret everything and record what
+ * it ran into DIR for aot.py (see aot.cpp).
+ *
+ * --jit-thread moves compiling traces for jit and cnp onto a thread of its own,
+ * and --jit-cache DIR keeps what they compiled in DIR for the next run of the
+ * same program (see jit.cpp). --jit-size KB limits their code cache, which
+ * evicts the oldest traces when it fills up, and --stats also reports that.
+ *
+ * --perf-map names the native code jit and cnp generate in /tmp/perf-PID.map
+ * for perf, and --jitdump in /tmp/jit-PID.dump too (see perf.h).
+**/
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <ctime>
+#include <algorithm>
+
+#include "um.h"
+#include "io.h"
+#include "perf.h"
+#include "check.h"
+#include "aot.h"
+#include "jit.h"
+
+#define MAX_RUNS 16
+#define CHECK_INTERVAL (1 << 24) // Default instructions between checkpoints
+
+struct EngineDef {
+    const char *name;
+    Engine run;
+};
+
+/**
+ * The first one is the default. hw1 (the arena engine) is known to fail
+ * sandmark and is only kept for comparison.
+**/
+static const EngineDef engines[] = {
+    {"try", try_run},
+    {"try4", try4_run},
+    {"trap", trap_run},
+    {"aot", aot_run},
+    {"jit", jit_run},
+    {"cnp", cnp_run},
+    {"hw1c", hw1c_run},
+    {"hw1", hw1_run}
+};
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+const char *errname(Error err) {
+    switch(err) {
+        case ERR_OK: return "OK";
+        case ERR_INV: return "INV";
+        case ERR_ARR: return "ARR";
+        case ERR_DEL: return "DEL";
+        case ERR_DIV: return "DIV";
+        case ERR_PRG: return "PRG";
+        case ERR_CHR: return "CHR";
+        case ERR_EOF: return "EOF";
+        default: return "Unknown error";
+    }
+}
+
+static const EngineDef *find_engine(const char *name, size_t len) {
+    for(size_t i = 0; i < NENGINES; ++i) {
+        if(std::strlen(engines[i].name) == len
+            && std::strncmp(engines[i].name, name, len) == 0) {
+            return &engines[i];
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Parse a comma separated list of engine names (or "all") into runs.
+ * Returns the number of runs or -1 on an unknown name.
+**/
+static int parse_engines(const char *list, const EngineDef **runs) {
+    if(std::strcmp(list, "all") == 0) {
+        for(size_t i = 0; i < NENGINES; ++i) runs[i] = &engines[i];
+        return NENGINES;
+    }
+
+    int nruns = 0;
+    for(;;) {
+        const char *comma = std::strchr(list, ',');
+        size_t len = comma? (size_t)(comma - list) : std::strlen(list);
+        const EngineDef *def = find_engine(list, len);
+        if(!def || nruns == MAX_RUNS) {
+            fprintf(stderr, "Unknown engine '%.*s', expected", (int)len, list);
+            for(size_t i = 0; i < NENGINES; ++i) {
+                fprintf(stderr, " %s", engines[i].name);
+            }
+            fprintf(stderr, " or all\n");
+            return -1;
+        }
+        runs[nruns++] = def;
+        if(!comma) return nruns;
+        list = comma + 1;
+    }
+}
+
+/**
+ * Read a big-endian program image. Trailing bytes which don't make up a whole
+ * word are ignored. Returns nullptr with errno set if the file can't be opened,
+ * sized (a pipe, say) or read, or there's no memory for it.
+**/
+static reg_t *load_program(const char *path, reg_t *size) {
+    FILE *fp = fopen(path, "rb");
+    if(!fp) return nullptr;
+
+    long bytes = -1;
+    reg_t *data = nullptr;
+    if(fseek(fp, 0, SEEK_END) == 0) bytes = ftell(fp);
+    if(bytes >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        data = (reg_t *)std::malloc(bytes + 1);
+    }
+    if(data) {
+        *size = fread(data, sizeof(reg_t), bytes / sizeof(reg_t), fp);
+        if(ferror(fp)) {
+            std::free(data);
+            data = nullptr;
+        }
+    }
+
+    int error = errno;
+    fclose(fp);
+    errno = error;
+    if(!data) return nullptr;
+
+    for(reg_t i = 0; i < *size; ++i) {
+        data[i] = __builtin_bswap32(data[i]);
+    }
+    return data;
+}
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    const char *program = nullptr;
+    const char *recording = nullptr;
+    bool stats = false;
+    bool perf = false;
+    uint64_t perf_every = 0;
+    int perf_map = 0; // 1 for just the map, 2 with a jitdump
+    const EngineDef *checked = nullptr;
+    uint64_t check_every = CHECK_INTERVAL;
+    const EngineDef *runs[MAX_RUNS] = {&engines[0]};
+    int nruns = 1;
+
+    for(int i = 1; i < argc; ++i) {
+        if(std::strncmp(argv[i], "--engine=", 9) == 0) {
+            nruns = parse_engines(argv[i] + 9, runs);
+            if(nruns < 0) return -1;
+        }
+        else if(std::strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            if(input_open(argv[++i])) {
+                perror("Failed to open input file");
+                return -1;
+            }
+        }
+        else if(std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recording = argv[++i];
+        }
+        else if(std::strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+            jit_stats = true;
+        }
+        else if(std::strcmp(argv[i], "--perf") == 0) {
+            perf = true;
+        }
+        else if(std::strcmp(argv[i], "--perf-interval") == 0 && i + 1 < argc) {
+            perf = true;
+            perf_every = std::strtoull(argv[++i], nullptr, 0);
+        }
+        else if(std::strcmp(argv[i], "--perf-map") == 0) {
+            perf_map = std::max(perf_map, 1);
+        }
+        else if(std::strcmp(argv[i], "--jitdump") == 0) {
+            perf_map = 2;
+        }
+        else if(std::strncmp(argv[i], "--check=", 8) == 0) {
+            const char *name = argv[i] + 8;
+            checked = find_engine(name, std::strlen(name));
+            if(!checked) {
+                fprintf(stderr, "Unknown engine '%s'\n", name);
+                return -1;
+            }
+        }
+        else if(std::strcmp(argv[i], "--check-interval") == 0 && i + 1 < argc) {
+            check_every = std::strtoull(argv[++i], nullptr, 0);
+        }
+        else if(std::strcmp(argv[i], "--aot-profile") == 0 && i + 1 < argc) {
+            aot_profile = argv[++i];
+        }
+        else if(std::strcmp(argv[i], "--jit-thread") == 0) {
+            jit_thread = true;
+        }
+        else if(std::strcmp(argv[i], "--jit-cache") == 0 && i + 1 < argc) {
+            jit_cache = argv[++i];
+        }
+        else if(std::strcmp(argv[i], "--jit-size") == 0 && i + 1 < argc) {
+            jit_size = std::strtoull(argv[++i], nullptr, 0) << 10;
+        }
+        else if(std::strcmp(argv[i], "--async-output") == 0) {
+            io_async();
+        }
+        else if(std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            if(io_replay(argv[++i])) {
+                perror("Failed to load recording");
+                return -1;
+            }
+        }
+        else if(program == nullptr) {
+            program = argv[i];
+        }
+        else {
+            program = nullptr;
+            break;
+        }
+    }
+
+    if(program == nullptr) {
+        fprintf(stderr,
+            "Usage: %s [--engine=NAME[,NAME...]|all] [--input FILE] "
+            "[--record FILE | --replay FILE] [--async-output] [--stats] "
+            "[--perf] [--perf-interval N] [--perf-map] [--jitdump] "
+            "[--check=NAME [--check-interval N]] [--aot-profile DIR] "
+            "[--jit-thread] [--jit-cache DIR] [--jit-size KB] <program>\n",
+            argv[0]
+        );
+        return 0;
+    }
+
+    // A recording is of one session, a second run would append to it
+    if(recording) {
+        if(nruns > 1 || checked) {
+            fprintf(stderr, "--record only works with a single engine\n");
+            return -1;
+        }
+        if(io_record(recording)) {
+            perror("Failed to open recording");
+            return -1;
+        }
+    }
+
+    if(perf && perf_open(perf_every)) {
+        fprintf(stderr, "No hardware counters available, ignoring --perf\n");
+    }
+    if(perf_map && perf_map_open(perf_map == 2)) {
+        perror("Failed to create perf map");
+    }
+
+    reg_t size;
+    reg_t *prog = load_program(program, &size);
+    if(!prog) {
+        perror("Failed to load program file");
+        return -1;
+    }
+
+    if(checked) {
+        int status = check_run(
+            engines[0].run, engines[0].name, checked->run, checked->name,
+            prog, size, check_every
+        );
+        std::free(prog);
+        perf_map_close();
+        return status;
+    }
+
+    int status = 0;
+    for(int i = 0; i < nruns; ++i) {
+        if(io_begin()) {
+            perror("Failed to start output thread");
+            return -1;
+        }
+
+        uint64_t steps = 0;
+        double start = now();
+        perf_phase(PERF_LOAD);
+        Error err = runs[i]->run(prog, size, &steps);
+        perf_phase(PERF_DONE);
+        double elapsed = now() - start;
+
+        bool diverged = io_finish(steps);
+        if(err) {
+            fprintf(stderr, "ERR_%s\n", errname(err));
+        }
+        if(stats || nruns > 1) {
+            fprintf(stderr,
+                "%s: %s, %" PRIu64 " instructions in %.6fs (%.1f MIPS)\n",
+                runs[i]->name, errname(err), steps, elapsed,
+                steps / elapsed / 1e6
+            );
+        }
+        perf_report(runs[i]->name, steps);
+
+        if(status == 0) {
+            status = err? err : diverged? -1 : 0;
+        }
+    }
+
+    std::free(prog);
+    perf_map_close();
+    return status;
+}
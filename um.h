@@ -0,0 +1,76 @@
+/**
+ * Definitions shared by every engine in the um binary. Each engine keeps its
+ * own VM representation and dispatch loop, this is only the instruction set,
+ * error codes and the entry points um.cpp selects between with --engine.
+ *
+ * Kept C-compatible so hw1.c can stay C.
+**/
+#ifndef UM_H
+#define UM_H
+
+#include <stdint.h>
+
+// XXXX .... .... .... .... ...A AABB BCCC (generic)
+// 1101 III. NNNN NNNN NNNN NNNN NNNN NNNN (ldi)
+#define OPCODE(n) ((n) >> 28)
+#define RX(n, x) (((x) >> ((n)*3)) & 7)
+
+#define OP_MOV  0 // A <- B unless C = 0
+#define OP_LDA  1 // A <- B[C]
+#define OP_STA  2 // A[B] <- C
+#define OP_ADD  3 // A <- B + C mod 2^32
+#define OP_MUL  4 // A <- B * C mod 2^32
+#define OP_DIV  5 // A <- int(B / C)
+#define OP_NAN  6 // A <- ~(B & C)
+#define OP_HLT  7 // halt execution
+#define OP_NEW  8 // B <- new reg_t[C]
+#define OP_DEL  9 // delete C
+#define OP_OUT 10 // putc(C)
+#define OP_INP 11 // C <- getc(), -1 EOF
+#define OP_PRG 12 // prog <- copy(B); PC <- C
+#define OP_LDI 13 // A <- N
+
+#define OP_INVALID 14
+#define OP_x14  14
+#define OP_x15  15 // Defined for completion's sake
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    ERR_OK = 0,
+    ERR_INV, // Invalid instruction
+    ERR_ARR, // Inactive array identifier
+    ERR_DEL, // Deleted 0 or inactive array
+    ERR_DIV, // Division by zero
+    ERR_PRG, // Loaded program from inactive array
+    ERR_CHR, // Printed character outside of [0, 255]
+    ERR_EOF  // PC out of bounds
+} Error;
+
+typedef uint32_t reg_t;
+
+const char *errname(Error err);
+
+/**
+ * Run a program to completion. The engine copies prog into its own memory so
+ * the same image can be run by several engines in a row, and counts every
+ * instruction it dispatches (including the one that halts or fails) in steps.
+**/
+typedef Error (*Engine)(const reg_t *prog, reg_t size, uint64_t *steps);
+
+Error try_run(const reg_t *prog, reg_t size, uint64_t *steps); // try.cpp
+Error try4_run(const reg_t *prog, reg_t size, uint64_t *steps); // try4.cpp
+Error trap_run(const reg_t *prog, reg_t size, uint64_t *steps); // trap.cpp
+Error hw1_run(const reg_t *prog, reg_t size, uint64_t *steps); // hw1.cpp
+Error hw1c_run(const reg_t *prog, reg_t size, uint64_t *steps); // hw1.c
+Error aot_run(const reg_t *prog, reg_t size, uint64_t *steps); // aot.cpp
+Error jit_run(const reg_t *prog, reg_t size, uint64_t *steps); // jit.cpp
+Error cnp_run(const reg_t *prog, reg_t size, uint64_t *steps); // jit.cpp
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
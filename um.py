@@ -1,6 +1,13 @@
 #!/usr/bin/env python3
 
-from itertools import batched
+try:
+    from itertools import batched
+except ImportError: # Python < 3.12
+    from itertools import islice
+    def batched(iterable, n):
+        it = iter(iterable)
+        while chunk := tuple(islice(it, n)):
+            yield chunk
 import re
 from typing import DefaultDict, Iterable
 
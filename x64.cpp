@@ -0,0 +1,841 @@
+/**
+ * Trace compiler for the JIT (see jit.h), straight from recorded instructions
+ * to x86-64. Host registers are
+ *
+ * - rbx: JitState
+ * - r12: s->arrays, reloaded after anything that can grow the index
+ * - r14: s->steps, which is only brought up to date at each prg, before
+ *   calls that read it and when leaving
+ * - rbp, r15, r13, r8-r11 and rdi: UM registers 0 to 7 (see host)
+ *
+ * and rax, rcx, rdx and rsi are scratch. They're set up by the trampoline,
+ * which all traces share, so traces can jump straight into each other with the
+ * UM registers where they are. JitState only has them while the trace is
+ * left, or around calls that could clobber them or read them. Anything that
+ * can fail gets a branch to an out of line stub that leaves for the
+ * interpreter at that instruction.
+ *
+ * A trace only ever runs from the top, so whatever ldi put in a register is
+ * known until something else writes it. Known registers are used as
+ * immediates, instructions with nothing but known operands are worked out
+ * here and compile to nothing, and a known value is only moved into its host
+ * register when the trace can leave: at a prg, at the end, or in the stub of
+ * anything that can fault. Writes that are written over again before anything
+ * reads them, or the trace could leave, aren't done at all (see dead_writes). A
+ * div by a known constant, or by the same thing every time it was recorded
+ * (behind a guard), multiplies by the reciprocal instead.
+ *
+ * UM only has nan, so compilers build NOT, AND, OR and subtraction out of a
+ * few instructions in a row. Those sequences are compiled as the one host
+ * instruction they stand for, still writing every register the originals
+ * would have.
+ *
+ * Strings are printed with an ldi and an out per character. A run of outs of
+ * known characters, with nothing but ldi in between, is one call that writes
+ * all of it from a copy kept at the end of the trace. Like everything else
+ * it's thrown away with the trace when any of those words is stored to.
+**/
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "um.h"
+#include "jit.h"
+#include "x64.h"
+
+using namespace x64;
+
+namespace {
+
+#define R(x) mem(RBX, offsetof(JitState, registers) + 4 * (x))
+#define S(field) mem(RBX, offsetof(JitState, field))
+
+// Where each UM register lives, and which of those calls clobber
+const Reg host[8] = {RBP, R15, R13, R8, R9, R10, R11, RDI};
+const uint8_t CLOBBERED = 0xf8;
+
+/**
+ * Cold code emitted after the trace. pending is how many instructions ran
+ * since r14 was last updated, not counting the one at pc, and dirty the known
+ * registers not in their host registers yet at that point.
+**/
+struct Stub {
+    enum Kind {
+        FAULT, // Leave at pc for the interpreter
+        JUMP, // Failed guard, go to ecx
+        EVENT, // Checkpoint or perf sample due at the prg at pc
+        STORE // Store to array 0 at pc
+    } kind;
+    Label entry, back;
+    reg_t pc, word;
+    uint32_t pending;
+    uint32_t ic;
+    uint8_t dirty;
+    reg_t values[8];
+};
+
+/**
+ * Which instructions write a register that's written again before anything
+ * reads it. Every register has to be up to date wherever the trace can leave,
+ * which is the end and any instruction that can fault.
+**/
+bool *dead_writes(const TraceOp *ops, uint32_t nops) {
+    bool *dead = (bool *)std::malloc(nops * sizeof(bool) + 1);
+    uint8_t live = 0xff;
+    for(uint32_t i = nops; i-- > 0;) {
+        reg_t cur = ops[i].word;
+        uint8_t a = 1 << RX(2, cur), b = 1 << RX(1, cur), c = 1 << RX(0, cur);
+        uint8_t reads = 0, writes = 0;
+        bool leaves = false;
+        switch(OPCODE(cur)) {
+            case OP_MOV:
+                // Only written when rc isn't 0
+                reads = a | b | c;
+                writes = a;
+                break;
+
+            case OP_ADD: case OP_MUL: case OP_NAN:
+                reads = b | c;
+                writes = a;
+                break;
+
+            case OP_LDA: case OP_DIV:
+                reads = b | c;
+                writes = a;
+                leaves = true;
+                break;
+
+            case OP_NEW:
+                reads = c;
+                writes = b;
+                break;
+
+            case OP_INP:
+                writes = c;
+                break;
+
+            case OP_LDI:
+                writes = 1 << ((cur >> 25) & 7);
+                break;
+
+            default:
+                leaves = true;
+        }
+        dead[i] = writes && !(live & writes);
+        live = (live & ~writes) | reads;
+        if(leaves) live = 0xff;
+    }
+    return dead;
+}
+
+// Characters of a run of outs, in Compiler::text from start
+struct String {
+    Label at;
+    size_t start, length;
+};
+
+struct Compiler {
+    Asm a;
+    Label top, done;
+
+    const TraceOp *ops;
+    bool *dead; // From dead_writes
+
+    // Registers holding a known constant, one bit each, and what it is. The
+    // dirty ones haven't been moved into their host registers yet.
+    uint8_t known = 0, dirty = 0;
+    reg_t values[8];
+
+    Stub *stubs = nullptr;
+    size_t nstubs = 0, capacity = 0;
+
+    // Every string printed so far, the run not printed yet starts at run
+    uint8_t *text = nullptr;
+    size_t ntext = 0, text_capacity = 0, run = 0;
+    String *strings = nullptr;
+    size_t nstrings = 0, strings_capacity = 0;
+
+    ~Compiler() {
+        std::free(dead);
+        std::free(stubs);
+        std::free(text);
+        std::free(strings);
+    }
+
+    // Index of the new stub, stubs can move as more are added
+    size_t stub(
+        Stub::Kind kind, reg_t pc, reg_t word, uint32_t pending, uint32_t ic = 0
+    ) {
+        if(nstubs == capacity) {
+            capacity = capacity? capacity * 2 : 64;
+            stubs = (Stub *)std::realloc(stubs, capacity * sizeof(Stub));
+        }
+        Stub &added = stubs[nstubs];
+        added = {kind, a.label(), a.label(), pc, word, pending, ic, dirty, {}};
+        std::memcpy(added.values, values, sizeof(values));
+        return nstubs++;
+    }
+
+    void flush_steps(uint32_t n) {
+        if(n) a.alu64(ALU_ADD, R14, n);
+    }
+
+    void set(int r, reg_t value) {
+        known |= 1 << r;
+        dirty |= 1 << r;
+        values[r] = value;
+    }
+
+    void kill(int r) {
+        known &= ~(1 << r);
+        dirty &= ~(1 << r);
+    }
+
+    bool constant(int r, reg_t *value) {
+        *value = values[r];
+        return known >> r & 1;
+    }
+
+    // Move the known registers in `mask` into their host registers, which
+    // clobbers the flags
+    void materialize(uint8_t mask, const reg_t *values) {
+        for(int r = 0; r < 8; ++r) {
+            if(mask >> r & 1) a.mov(host[r], values[r]);
+        }
+    }
+
+    void materialize() {
+        materialize(dirty, values);
+        dirty = 0;
+    }
+
+    // Store the registers in `mask` to JitState, or load them back
+    void spill(uint8_t mask) {
+        for(int r = 0; r < 8; ++r) {
+            if(mask >> r & 1) a.store(R(r), host[r]);
+        }
+    }
+
+    void fill(uint8_t mask) {
+        for(int r = 0; r < 8; ++r) {
+            if(mask >> r & 1) a.load(host[r], R(r));
+        }
+    }
+
+    /**
+     * Around a call from the trace. Known registers aren't kept, they're
+     * dirty again afterwards instead.
+    **/
+    void before_call() {
+        spill(CLOBBERED & ~known);
+    }
+
+    void after_call() {
+        fill(CLOBBERED & ~known);
+        dirty |= known & CLOBBERED;
+    }
+
+    // dst = UM register r
+    void get(Reg dst, int r) {
+        if(known >> r & 1) a.mov(dst, values[r]);
+        else a.mov(dst, host[r]);
+    }
+
+    // dst op= UM register r
+    void get(Alu op, Reg dst, int r) {
+        if(known >> r & 1) a.alu(op, dst, (int32_t)values[r]);
+        else a.alu(op, dst, host[r]);
+    }
+
+    // The host register with UM register r in it, or scratch with the constant
+    Reg use(int r, Reg scratch) {
+        if(!(known >> r & 1)) return host[r];
+        a.mov(scratch, values[r]);
+        return scratch;
+    }
+
+    // UM register r = src, written by instruction i
+    void put(int r, Reg src, uint32_t i) {
+        if(!dead[i] && src != host[r]) a.mov(host[r], src);
+        kill(r);
+    }
+
+    /**
+     * eax = eax / d for d > 0, clobbers rcx and rdx. Past a power of two it's
+     * the high half of eax * ceil(2^64 / d), which Lemire, Kaser and Kurz show
+     * is exact for every 32-bit eax and d ("Faster Remainder by Direct
+     * Computation", 2019).
+    **/
+    void divide(reg_t d) {
+        if((d & (d - 1)) == 0) {
+            if(d > 1) a.shr(RAX, __builtin_ctz(d));
+            return;
+        }
+        a.mov64(RCX, UINT64_MAX / d + 1);
+        a.mul64(RCX);
+        a.mov(RAX, RDX);
+    }
+
+    // Whether ops[i] can be in a run of outs without printing it first
+    bool quiet(uint32_t i) {
+        reg_t cur = ops[i].word, c;
+        if(OPCODE(cur) == OP_LDI) return true;
+        return OPCODE(cur) == OP_OUT && constant(RX(0, cur), &c) && c <= 0xff;
+    }
+
+    void append(uint8_t c) {
+        if(ntext == text_capacity) {
+            text_capacity = text_capacity? text_capacity * 2 : 256;
+            text = (uint8_t *)std::realloc(text, text_capacity);
+        }
+        text[ntext++] = c;
+    }
+
+    // Print the run of outs so far
+    void print() {
+        size_t n = ntext - run;
+        if(n == 1) {
+            before_call();
+            a.mov(RDI, (uint32_t)text[run]);
+            a.call(S(out));
+            after_call();
+            ntext = run;
+        }
+        else if(n > 1) {
+            if(nstrings == strings_capacity) {
+                strings_capacity = strings_capacity? strings_capacity * 2 : 16;
+                strings = (String *)std::realloc(
+                    strings, strings_capacity * sizeof(String)
+                );
+            }
+            Label at = a.label();
+            strings[nstrings++] = {at, run, n};
+            before_call();
+            a.lea(RDI, at);
+            a.mov(RSI, (uint32_t)n);
+            a.call(S(out_string));
+            after_call();
+            run = ntext;
+        }
+    }
+
+    void leave(JitExit exit) {
+        a.mov(RAX, (uint32_t)exit);
+        a.jmp(done);
+    }
+
+    /**
+     * ident in eax, leaves the address of the array's entry in rcx and its
+     * data in rdx, or goes to fault if it's inactive or empty.
+    **/
+    void array(Label fault) {
+        a.alu(ALU_CMP, RAX, S(narrays));
+        a.jcc(CC_AE, fault);
+        a.mov(RCX, RAX);
+        a.shl64(RCX, 4);
+        a.alu64(ALU_ADD, RCX, R12);
+        a.load64(RDX, mem(RCX, offsetof(JitArray, data)));
+        a.test64(RDX, RDX);
+        a.jcc(CC_E, fault);
+    }
+
+    /**
+     * Jump to the trace for ecx through inline cache `ic`, filling it from
+     * s->entries on a miss, or leave with pc = ecx if there isn't one.
+    **/
+    void dispatch(uint32_t ic) {
+        Label miss = a.label(), second = a.label(), gone = a.label();
+        int32_t at = ic * sizeof(JitIc);
+        Mem pc0 = mem(RDX, at + offsetof(JitIc, pc));
+        Mem pc1 = mem(RDX, at + offsetof(JitIc, pc) + 4);
+        Mem code0 = mem(RDX, at + offsetof(JitIc, code));
+        Mem code1 = mem(RDX, at + offsetof(JitIc, code) + 8);
+
+        // Past the end is never in a cache, even the 0xffffffff of a fresh one
+        a.alu(ALU_CMP, RCX, S(nentries));
+        a.jcc(CC_AE, gone);
+        a.load64(RDX, S(ics));
+        a.alu(ALU_CMP, RCX, pc0);
+        a.jcc(CC_NE, second);
+        a.jmp(code0);
+        a.bind(second);
+        a.alu(ALU_CMP, RCX, pc1);
+        a.jcc(CC_NE, miss);
+        a.jmp(code1);
+
+        a.bind(miss);
+        a.load64(RAX, S(entries));
+        a.load64(RAX, mem(RAX, RCX, 8));
+        a.test64(RAX, RAX);
+        a.jcc(CC_E, gone);
+        a.load(RSI, pc0);
+        a.store(pc1, RSI);
+        a.load64(RSI, code0);
+        a.store64(code1, RSI);
+        a.store(pc0, RCX);
+        a.store64(code0, RAX);
+        a.jmp(RAX);
+
+        a.bind(gone);
+        a.store(S(pc), RCX);
+        leave(JIT_JUMP);
+    }
+
+    void epilogue() {
+        spill(0xff);
+        a.store64(S(steps), R14);
+        a.alu64(ALU_ADD, RSP, 8);
+        a.pop(R15);
+        a.pop(R14);
+        a.pop(R13);
+        a.pop(R12);
+        a.pop(RBP);
+        a.pop(RBX);
+        a.ret();
+    }
+
+    /**
+     * Compile ops[i] and return the new pending count. last is set for the
+     * final op of a trace that doesn't loop, where a prg 0 just leaves for
+     * wherever it goes.
+    **/
+    uint32_t op(uint32_t i, uint32_t pending, bool last, bool loops) {
+        const TraceOp &op = ops[i];
+        reg_t cur = op.word;
+        int ra = RX(2, cur), rb = RX(1, cur), rc = RX(0, cur);
+        reg_t b, c;
+        bool kb = constant(rb, &b), kc = constant(rc, &c);
+        Label fault = 0;
+        bool faults = false;
+        auto fail = [&]() {
+            if(!faults) {
+                size_t at = stub(Stub::FAULT, op.pc, cur, pending);
+                fault = stubs[at].entry;
+                faults = true;
+            }
+            return fault;
+        };
+
+        // Nothing to do for a dead write that can't fault either
+        switch(OPCODE(cur)) {
+            case OP_DIV:
+                if(!kc || !c) break;
+                [[fallthrough]];
+            case OP_MOV: case OP_ADD: case OP_MUL: case OP_NAN: case OP_LDI:
+                if(!dead[i]) break;
+                kill(OPCODE(cur) == OP_LDI? (cur >> 25) & 7 : ra);
+                return pending + 1;
+        }
+
+        switch(OPCODE(cur)) {
+            case OP_MOV: {
+                if(kc) {
+                    if(!c) break;
+                    if(kb) set(ra, b);
+                    else put(ra, host[rb], i);
+                    break;
+                }
+                Reg src = use(rb, RCX);
+                if(known >> ra & 1) {
+                    get(RAX, ra);
+                    a.test(host[rc], host[rc]);
+                    a.cmov(CC_NE, RAX, src);
+                    put(ra, RAX, i);
+                    break;
+                }
+                a.test(host[rc], host[rc]);
+                a.cmov(CC_NE, host[ra], src);
+                break;
+            }
+
+            case OP_LDA: {
+                get(RAX, rb);
+                array(fail());
+                Reg index = use(rc, RSI);
+                a.alu(ALU_CMP, index, mem(RCX, offsetof(JitArray, size)));
+                a.jcc(CC_AE, fail());
+                a.load(RAX, mem(RDX, index, 4));
+                put(ra, RAX, i);
+                break;
+            }
+
+            case OP_STA: {
+                size_t code = stub(Stub::STORE, op.pc, cur, pending);
+                get(RAX, ra);
+                a.test(RAX, RAX);
+                a.jcc(CC_E, stubs[code].entry);
+                array(fail());
+                Reg index = use(rb, RSI);
+                a.alu(ALU_CMP, index, mem(RCX, offsetof(JitArray, size)));
+                a.jcc(CC_AE, fail());
+                if(kc) a.store(mem(RDX, index, 4), c);
+                else a.store(mem(RDX, index, 4), host[rc]);
+                a.bind(stubs[code].back);
+                break;
+            }
+
+            case OP_ADD:
+                if(kb && kc) {
+                    set(ra, b + c);
+                    break;
+                }
+                get(RAX, rb);
+                get(ALU_ADD, RAX, rc);
+                put(ra, RAX, i);
+                break;
+
+            case OP_MUL:
+                if(kb && kc) {
+                    set(ra, b * c);
+                    break;
+                }
+                get(RAX, rb);
+                if(kc) {
+                    a.mov(RCX, c);
+                    a.imul(RAX, RCX);
+                }
+                else a.imul(RAX, host[rc]);
+                put(ra, RAX, i);
+                break;
+
+            case OP_DIV: {
+                if(kc && c) {
+                    if(kb) set(ra, b / c);
+                    else {
+                        a.mov(RAX, host[rb]);
+                        divide(c);
+                        put(ra, RAX, i);
+                    }
+                    break;
+                }
+
+                reg_t d;
+                Label done = a.label();
+                get(RCX, rc);
+                if((d = op.divisor)) {
+                    Label other = a.label();
+                    a.alu(ALU_CMP, RCX, (int32_t)d);
+                    a.jcc(CC_NE, other);
+                    get(RAX, rb);
+                    divide(d);
+                    a.jmp(done);
+                    a.bind(other);
+                }
+                a.test(RCX, RCX);
+                a.jcc(CC_E, fail());
+                get(RAX, rb);
+                a.alu(ALU_XOR, RDX, RDX);
+                a.div(RCX);
+                a.bind(done);
+                put(ra, RAX, i);
+                break;
+            }
+
+            case OP_NAN:
+                if(kb && kc) {
+                    set(ra, ~(b & c));
+                    break;
+                }
+                get(RAX, rb);
+                get(ALU_AND, RAX, rc);
+                a.not_(RAX);
+                put(ra, RAX, i);
+                break;
+
+            case OP_NEW:
+                before_call();
+                get(RSI, rc);
+                a.mov64(RDI, RBX);
+                a.call(S(new_array));
+                after_call();
+                put(rb, RAX, i);
+                a.load64(R12, S(arrays));
+                break;
+
+            case OP_DEL:
+                get(RSI, rc);
+                a.test(RSI, RSI);
+                a.jcc(CC_E, fail());
+                before_call();
+                a.mov64(RDI, RBX);
+                a.call(S(del_array));
+                after_call();
+                a.load64(R12, S(arrays));
+                break;
+
+            case OP_OUT:
+                if(kc) {
+                    if(c > 0xff) a.jmp(fail());
+                    else append(c);
+                    break;
+                }
+                a.alu(ALU_CMP, host[rc], 0xff);
+                a.jcc(CC_A, fail());
+                before_call();
+                a.mov(RDI, host[rc]);
+                a.call(S(out));
+                after_call();
+                break;
+
+            case OP_INP:
+                flush_steps(pending + 1);
+                a.store64(S(steps), R14);
+                before_call();
+                a.mov64(RDI, RBX);
+                a.call(S(inp));
+                after_call();
+                put(rc, RAX, i);
+                return 0;
+
+            case OP_PRG: {
+                // Wherever this goes, and the checkpoint, wants every register
+                materialize();
+
+                // A load becomes one here, which the interpreter does
+                a.test(host[rb], host[rb]);
+                a.jcc(CC_NE, fail());
+                flush_steps(pending + 1);
+
+                size_t event = stub(Stub::EVENT, op.pc, cur, 0);
+                a.alu64(ALU_CMP, R14, S(event));
+                a.jcc(CC_AE, stubs[event].entry);
+                a.bind(stubs[event].back);
+
+                if(last && !loops) {
+                    a.mov(RCX, host[rc]);
+                    dispatch(op.ic);
+                    return 0;
+                }
+                // The same ldi as when it was recorded
+                if(!kc || c != op.target) {
+                    a.mov(RCX, host[rc]);
+                    a.alu(ALU_CMP, RCX, (int32_t)op.target);
+                    size_t jump = stub(Stub::JUMP, op.pc, cur, 0, op.ic);
+                    a.jcc(CC_NE, stubs[jump].entry);
+                }
+                if(last) a.jmp(top);
+                return 0;
+            }
+
+            case OP_LDI:
+                set((cur >> 25) & 7, cur & 0x01ffffff);
+                break;
+
+            default:
+                // Recording stops before anything else
+                std::abort();
+        }
+        return pending + 1;
+    }
+
+    /**
+     * Compile the nan idiom starting at ops[i], if there is one, and return how
+     * many instructions it took. There are no faults in any of them so only
+     * the end result needs to be right.
+    **/
+    uint32_t idiom(uint32_t i, uint32_t nops) {
+        auto is = [&](uint32_t j, reg_t opcode) {
+            return i + j < nops && OPCODE(ops[i + j].word) == opcode;
+        };
+        auto A = [&](uint32_t j) { return (int)RX(2, ops[i + j].word); };
+        auto B = [&](uint32_t j) { return (int)RX(1, ops[i + j].word); };
+        auto C = [&](uint32_t j) { return (int)RX(0, ops[i + j].word); };
+        if(!is(0, OP_NAN)) return 0;
+        int t = A(0), x = B(0), y = C(0);
+        // Left to op(), which works it out
+        if(known >> x & known >> y & 1) return 0;
+
+        // nan t y y; add t t k; add dst x t = t <- ~y + k, dst <- x - y - 1 + k
+        if(x == y && is(1, OP_ADD) && is(2, OP_ADD) && A(1) == t
+            && (B(1) == t) != (C(1) == t)
+            && (B(2) == t) != (C(2) == t)) {
+            int k = B(1) == t? C(1) : B(1), dst = A(2);
+            int other = B(2) == t? C(2) : B(2);
+            reg_t one;
+            a.mov(RAX, host[y]);
+            if(constant(k, &one) && one == 1) {
+                a.neg(RAX);
+            }
+            else {
+                a.not_(RAX);
+                get(ALU_ADD, RAX, k);
+            }
+            put(t, RAX, i + 1);
+            get(ALU_ADD, RAX, other);
+            put(dst, RAX, i + 2);
+            return 3;
+        }
+
+        // nan t x x; nan u y y; nan dst t u = t <- ~x, u <- ~y, dst <- x | y
+        if(x == y && is(1, OP_NAN) && is(2, OP_NAN) && B(1) == C(1)
+            && B(1) != t && A(1) != t
+            && ((B(2) == t && C(2) == A(1)) || (B(2) == A(1) && C(2) == t))) {
+            int u = A(1), dst = A(2);
+            a.mov(RAX, host[x]);
+            get(RCX, B(1));
+            a.mov(RDX, RAX);
+            a.not_(RDX);
+            put(t, RDX, i);
+            a.mov(RDX, RCX);
+            a.not_(RDX);
+            put(u, RDX, i + 1);
+            a.alu(ALU_OR, RAX, RCX);
+            put(dst, RAX, i + 2);
+            return 3;
+        }
+
+        // nan t x y; nan a t t = t <- ~(x & y), a <- x & y
+        if(is(1, OP_NAN) && B(1) == t && C(1) == t) {
+            get(RAX, x);
+            get(ALU_AND, RAX, y);
+            a.mov(RCX, RAX);
+            a.not_(RCX);
+            put(t, RCX, i);
+            put(A(1), RAX, i + 1);
+            return 2;
+        }
+
+        // nan a y y = ~y
+        if(x == y) {
+            a.mov(RAX, host[y]);
+            a.not_(RAX);
+            put(t, RAX, i);
+            return 1;
+        }
+        return 0;
+    }
+
+    void emit_stubs() {
+        for(size_t i = 0; i < nstubs; ++i) {
+            const Stub &stub = stubs[i];
+            a.bind(stub.entry);
+            materialize(stub.dirty, stub.values);
+            switch(stub.kind) {
+                case Stub::FAULT:
+                    flush_steps(stub.pending);
+                    a.store(S(pc), stub.pc);
+                    leave(JIT_INTERP);
+                    break;
+
+                case Stub::JUMP:
+                    dispatch(stub.ic);
+                    break;
+
+                case Stub::EVENT:
+                    // Checkpoints read every register
+                    a.store64(S(steps), R14);
+                    spill(0xff);
+                    a.mov64(RDI, RBX);
+                    a.mov(RSI, stub.pc + 1);
+                    a.mov(RDX, stub.word);
+                    a.call(S(event_at));
+                    fill(CLOBBERED);
+                    a.jmp(stub.back);
+                    break;
+
+                case Stub::STORE: {
+                    // Leave if it failed or changed compiled code, which might
+                    // be this trace
+                    Label fail = a.label();
+                    spill(CLOBBERED);
+                    a.mov(RSI, host[RX(1, stub.word)]);
+                    a.mov(RDX, host[RX(0, stub.word)]);
+                    a.mov64(RDI, RBX);
+                    a.call(S(store_code));
+                    fill(CLOBBERED);
+                    a.test(RAX, RAX);
+                    a.jcc(CC_E, stub.back);
+                    a.alu(ALU_CMP, RAX, 1);
+                    a.jcc(CC_E, fail);
+                    flush_steps(stub.pending + 1);
+                    a.store(S(pc), stub.pc + 1);
+                    leave(JIT_INTERP);
+                    a.bind(fail);
+                    flush_steps(stub.pending);
+                    a.store(S(pc), stub.pc);
+                    leave(JIT_INTERP);
+                    break;
+                }
+            }
+        }
+    }
+
+    void emit_strings() {
+        for(size_t i = 0; i < nstrings; ++i) {
+            a.bind(strings[i].at);
+            for(size_t j = 0; j < strings[i].length; ++j) {
+                a.byte(text[strings[i].start + j]);
+            }
+        }
+    }
+};
+
+uint8_t *compile(
+    const TraceOp *ops, uint32_t nops, bool loops, reg_t next, size_t *size
+) {
+    Compiler c;
+    c.ops = ops;
+    c.dead = dead_writes(ops, nops);
+    c.top = c.a.label();
+    c.done = c.a.label();
+
+    c.a.bind(c.top);
+    uint32_t pending = 0;
+    for(uint32_t i = 0; i < nops;) {
+        if(!c.quiet(i)) c.print();
+        if(uint32_t n = c.idiom(i, nops)) {
+            pending += n;
+            i += n;
+            continue;
+        }
+        pending = c.op(i, pending, i == nops - 1, loops);
+        ++i;
+    }
+    if(nops == 0 || OPCODE(ops[nops - 1].word) != OP_PRG) {
+        c.print();
+        c.materialize();
+        c.flush_steps(pending);
+        c.a.store(S(pc), next);
+        c.leave(JIT_INTERP);
+    }
+    c.emit_stubs();
+    c.a.bind(c.done);
+    c.epilogue();
+    c.emit_strings();
+
+    *size = c.a.size;
+    uint8_t *code = c.a.code;
+    c.a.code = nullptr;
+    return code;
+}
+
+/**
+ * Sets up the host registers and jumps to the trace in rsi. Traces leave
+ * through their own copy of the epilogue, which undoes this and stores the UM
+ * registers back.
+**/
+uint8_t *trampoline(size_t *size) {
+    Asm a;
+    a.push(RBX);
+    a.push(RBP);
+    a.push(R12);
+    a.push(R13);
+    a.push(R14);
+    a.push(R15);
+    a.alu64(ALU_SUB, RSP, 8); // Keep calls 16-byte aligned
+    a.mov64(RBX, RDI);
+    a.load64(R12, S(arrays));
+    a.load64(R14, S(steps));
+    for(int r = 0; r < 8; ++r) a.load(host[r], R(r));
+    a.jmp(RSI);
+
+    *size = a.size;
+    uint8_t *code = a.code;
+    a.code = nullptr;
+    return code;
+}
+
+}
+
+const JitBackend x64_backend = {compile, trampoline, "jit"};
@@ -0,0 +1,357 @@
+/**
+ * Just enough of an x86-64 assembler for x64.cpp. Code goes into a growable
+ * buffer and every jump is relative, so the result can be copied anywhere.
+ * Labels are indices, jumps to a label that isn't bound yet are patched when
+ * it is.
+**/
+#ifndef X64_H
+#define X64_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace x64 {
+
+enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    NOREG = -1
+};
+
+enum Cond {
+    CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+    CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G
+};
+
+// Opcode extension (the reg field of ModRM) of the 0x81/0x83 group
+enum Alu {
+    ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7
+};
+
+/**
+ * [base + index*scale + disp], index is NOREG if there isn't one.
+**/
+struct Mem {
+    Reg base;
+    Reg index;
+    int scale;
+    int32_t disp;
+};
+
+inline Mem mem(Reg base, int32_t disp = 0) {
+    return {base, NOREG, 1, disp};
+}
+
+inline Mem mem(Reg base, Reg index, int scale, int32_t disp = 0) {
+    return {base, index, scale, disp};
+}
+
+typedef uint32_t Label;
+
+struct Asm {
+    uint8_t *code = nullptr;
+    size_t size = 0, capacity = 0;
+
+    // Bound offset of each label, or -1
+    ptrdiff_t *labels = nullptr;
+    uint32_t nlabels = 0, label_capacity = 0;
+
+    // rel32 fields waiting for their label
+    struct Fixup {
+        size_t at;
+        Label label;
+    } *fixups = nullptr;
+    size_t nfixups = 0, fixup_capacity = 0;
+
+    ~Asm() {
+        std::free(code);
+        std::free(labels);
+        std::free(fixups);
+    }
+
+    void reset() {
+        size = 0;
+        nlabels = 0;
+        nfixups = 0;
+    }
+
+    void byte(uint8_t b) {
+        if(size == capacity) {
+            capacity = capacity? capacity * 2 : 4096;
+            code = (uint8_t *)std::realloc(code, capacity);
+        }
+        code[size++] = b;
+    }
+
+    void u32(uint32_t v) {
+        for(int i = 0; i < 4; ++i) byte(v >> (8 * i));
+    }
+
+    void u64(uint64_t v) {
+        for(int i = 0; i < 8; ++i) byte(v >> (8 * i));
+    }
+
+    Label label() {
+        if(nlabels == label_capacity) {
+            label_capacity = label_capacity? label_capacity * 2 : 64;
+            labels = (ptrdiff_t *)std::realloc(
+                labels, label_capacity * sizeof(ptrdiff_t)
+            );
+        }
+        labels[nlabels] = -1;
+        return nlabels++;
+    }
+
+    void bind(Label l) {
+        labels[l] = size;
+        for(size_t i = 0; i < nfixups;) {
+            if(fixups[i].label == l) {
+                patch(fixups[i].at, size);
+                fixups[i] = fixups[--nfixups];
+            }
+            else ++i;
+        }
+    }
+
+    void patch(size_t at, size_t target) {
+        int32_t rel = (int32_t)(target - (at + 4));
+        std::memcpy(&code[at], &rel, 4);
+    }
+
+    void rel32(Label l) {
+        if(labels[l] >= 0) {
+            u32(0);
+            patch(size - 4, labels[l]);
+            return;
+        }
+        if(nfixups == fixup_capacity) {
+            fixup_capacity = fixup_capacity? fixup_capacity * 2 : 64;
+            fixups = (Fixup *)std::realloc(
+                fixups, fixup_capacity * sizeof(Fixup)
+            );
+        }
+        fixups[nfixups++] = {size, l};
+        u32(0);
+    }
+
+    /**
+     * REX prefix, left out when it would be 0x40 unless forced (byte
+     * registers, which this never uses).
+    **/
+    void rex(bool w, int reg, int index, int base) {
+        uint8_t r = 0x40 | (w << 3) | ((reg >> 3) & 1) << 2
+            | ((index >> 3) & 1) << 1 | ((base >> 3) & 1);
+        if(r != 0x40) byte(r);
+    }
+
+    void rex(bool w, int reg, const Mem &m) {
+        rex(w, reg, m.index == NOREG? 0 : m.index, m.base);
+    }
+
+    void modrm(int mod, int reg, int rm) {
+        byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void operand(int reg, const Mem &m) {
+        int mod = m.disp == 0 && (m.base & 7) != RBP? 0
+            : m.disp == (int8_t)m.disp? 1 : 2;
+
+        if(m.index == NOREG && (m.base & 7) != RSP) {
+            modrm(mod, reg, m.base);
+        }
+        else {
+            int scale = m.scale == 8? 3 : m.scale == 4? 2 : m.scale == 2? 1 : 0;
+            int index = m.index == NOREG? RSP : m.index;
+            modrm(mod, reg, RSP);
+            byte((scale << 6) | ((index & 7) << 3) | (m.base & 7));
+        }
+
+        if(mod == 1) byte(m.disp);
+        else if(mod == 2) u32(m.disp);
+    }
+
+    // op reg, reg with the r/m operand as the destination (0x89, 0x01, ...)
+    void rr(bool w, uint8_t op, Reg dst, Reg src) {
+        rex(w, src, 0, dst);
+        byte(op);
+        modrm(3, src, dst);
+    }
+
+    void rm(bool w, uint8_t op, int reg, const Mem &m) {
+        rex(w, reg, m);
+        byte(op);
+        operand(reg, m);
+    }
+
+    void mov(Reg dst, Reg src) { rr(false, 0x89, dst, src); }
+    void mov64(Reg dst, Reg src) { rr(true, 0x89, dst, src); }
+    void load(Reg dst, const Mem &m) { rm(false, 0x8b, dst, m); }
+    void load64(Reg dst, const Mem &m) { rm(true, 0x8b, dst, m); }
+    void store(const Mem &m, Reg src) { rm(false, 0x89, src, m); }
+    void store64(const Mem &m, Reg src) { rm(true, 0x89, src, m); }
+    void lea(Reg dst, const Mem &m) { rm(true, 0x8d, dst, m); }
+
+    // lea dst, [rip + l]
+    void lea(Reg dst, Label l) {
+        rex(true, dst, 0, 0);
+        byte(0x8d);
+        modrm(0, dst, RBP);
+        rel32(l);
+    }
+
+    void mov(Reg dst, uint32_t imm) {
+        if(imm == 0) {
+            alu(ALU_XOR, dst, dst);
+            return;
+        }
+        rex(false, 0, 0, dst);
+        byte(0xb8 + (dst & 7));
+        u32(imm);
+    }
+
+    void mov64(Reg dst, uint64_t imm) {
+        if(imm == (uint32_t)imm) {
+            mov(dst, (uint32_t)imm);
+            return;
+        }
+        rex(true, 0, 0, dst);
+        byte(0xb8 + (dst & 7));
+        u64(imm);
+    }
+
+    void store(const Mem &m, uint32_t imm) {
+        rm(false, 0xc7, 0, m);
+        u32(imm);
+    }
+
+    // 32-bit op dst, src for add/or/and/sub/xor/cmp
+    void alu(Alu op, Reg dst, Reg src) { rr(false, 0x01 + op * 8, dst, src); }
+    void alu64(Alu op, Reg dst, Reg src) { rr(true, 0x01 + op * 8, dst, src); }
+    void alu(Alu op, Reg dst, const Mem &m) { rm(false, 0x03 + op * 8, dst, m); }
+    void alu64(Alu op, Reg dst, const Mem &m) { rm(true, 0x03 + op * 8, dst, m); }
+
+    void alu_imm(bool w, Alu op, int rmreg, const Mem *m, int32_t imm) {
+        bool small = imm == (int8_t)imm;
+        if(m) rex(w, 0, *m);
+        else rex(w, 0, 0, rmreg);
+        byte(small? 0x83 : 0x81);
+        if(m) operand(op, *m);
+        else modrm(3, op, rmreg);
+        if(small) byte(imm);
+        else u32(imm);
+    }
+
+    void alu(Alu op, Reg dst, int32_t imm) { alu_imm(false, op, dst, nullptr, imm); }
+    void alu64(Alu op, Reg dst, int32_t imm) { alu_imm(true, op, dst, nullptr, imm); }
+    void alu(Alu op, const Mem &m, int32_t imm) { alu_imm(false, op, 0, &m, imm); }
+    void alu64(Alu op, const Mem &m, int32_t imm) { alu_imm(true, op, 0, &m, imm); }
+
+    void test(Reg a, Reg b) { rr(false, 0x85, a, b); }
+    void test64(Reg a, Reg b) { rr(true, 0x85, a, b); }
+
+    void imul(Reg dst, Reg src) {
+        rex(false, dst, 0, src);
+        byte(0x0f);
+        byte(0xaf);
+        modrm(3, dst, src);
+    }
+
+    void imul(Reg dst, const Mem &m) {
+        rex(false, dst, m);
+        byte(0x0f);
+        byte(0xaf);
+        operand(dst, m);
+    }
+
+    // Unsigned edx:eax / src
+    void div(Reg src) {
+        rex(false, 0, 0, src);
+        byte(0xf7);
+        modrm(3, 6, src);
+    }
+
+    // Unsigned rdx:rax = rax * src
+    void mul64(Reg src) {
+        rex(true, 0, 0, src);
+        byte(0xf7);
+        modrm(3, 4, src);
+    }
+
+    void neg(Reg r) {
+        rex(false, 0, 0, r);
+        byte(0xf7);
+        modrm(3, 3, r);
+    }
+
+    void not_(Reg r) {
+        rex(false, 0, 0, r);
+        byte(0xf7);
+        modrm(3, 2, r);
+    }
+
+    void shr(Reg r, uint8_t n) {
+        rex(false, 0, 0, r);
+        byte(0xc1);
+        modrm(3, 5, r);
+        byte(n);
+    }
+
+    void shl64(Reg r, uint8_t n) {
+        rex(true, 0, 0, r);
+        byte(0xc1);
+        modrm(3, 4, r);
+        byte(n);
+    }
+
+    void shr64(Reg r, uint8_t n) {
+        rex(true, 0, 0, r);
+        byte(0xc1);
+        modrm(3, 5, r);
+        byte(n);
+    }
+
+    void cmov(Cond cc, Reg dst, Reg src) {
+        rex(false, dst, 0, src);
+        byte(0x0f);
+        byte(0x40 + cc);
+        modrm(3, dst, src);
+    }
+
+    void jcc(Cond cc, Label l) {
+        byte(0x0f);
+        byte(0x80 + cc);
+        rel32(l);
+    }
+
+    void jmp(Label l) {
+        byte(0xe9);
+        rel32(l);
+    }
+
+    void jmp(Reg r) {
+        rex(false, 0, 0, r);
+        byte(0xff);
+        modrm(3, 4, r);
+    }
+
+    void jmp(const Mem &m) { rm(false, 0xff, 4, m); }
+    void call(const Mem &m) { rm(false, 0xff, 2, m); }
+
+    void push(Reg r) {
+        rex(false, 0, 0, r);
+        byte(0x50 + (r & 7));
+    }
+
+    void pop(Reg r) {
+        rex(false, 0, 0, r);
+        byte(0x58 + (r & 7));
+    }
+
+    void ret() { byte(0xc3); }
+};
+
+}
+
+#endif